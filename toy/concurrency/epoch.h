@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace toy {
+
+/// Small numbers of the live threads, so that a thread can own an element of an array. The number is released when the thread exits.
+class ThreadSlots
+{
+public:
+    static constexpr size_t max_threads = 256;
+
+    static size_t current()
+    {
+        thread_local Holder holder;
+        return holder.slot;
+    }
+
+private:
+    struct Registry
+    {
+        std::mutex mutex;
+        std::bitset<max_threads> used;
+    };
+
+    static Registry & registry()
+    {
+        static Registry res;
+        return res;
+    }
+
+    struct Holder
+    {
+        size_t slot;
+
+        Holder()
+        {
+            Registry & reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            for (slot = 0; slot < max_threads && reg.used[slot]; ++slot)
+                ;
+            if (slot == max_threads)
+                throw "too many threads";
+            reg.used[slot] = true;
+        }
+
+        ~Holder()
+        {
+            Registry & reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            reg.used[slot] = false;
+        }
+    };
+};
+
+/** Epoch based reclamation. A reader publishes the global epoch in the record of its thread for the time it may touch shared memory,
+  *  which is a write to its own cache line only. A retired piece of memory gets the epoch of its retirement and the epoch is advanced,
+  *  so the readers which come later can't reach it. It is freed once every active reader has entered after that.
+  * `retire` and `reclaim` must be serialized by the caller, the readers may run at any time.
+  */
+class EpochDomain
+{
+    struct alignas(64) Record
+    {
+        /// Zero when the thread is not reading.
+        std::atomic<uint64_t> epoch{0};
+
+        /// Only touched by the owner thread.
+        size_t nesting = 0;
+    };
+
+    struct Retired
+    {
+        void * ptr;
+        size_t bytes;
+        uint64_t epoch;
+    };
+
+    std::atomic<uint64_t> global_epoch{1};
+
+    Record records[ThreadSlots::max_threads];
+
+    std::vector<Retired> retired;
+
+    /// The oldest epoch some reader may still be in.
+    uint64_t minActiveEpoch() const
+    {
+        uint64_t res = UINT64_MAX;
+        for (const Record & record : records)
+        {
+            uint64_t epoch = record.epoch.load();
+            if (epoch != 0 && epoch < res)
+                res = epoch;
+        }
+        return res;
+    }
+
+public:
+    /// The guards may be nested.
+    void enter()
+    {
+        Record & record = records[ThreadSlots::current()];
+        if (record.nesting++ == 0)
+            record.epoch.store(global_epoch.load());
+    }
+
+    void exit()
+    {
+        Record & record = records[ThreadSlots::current()];
+        if (--record.nesting == 0)
+            record.epoch.store(0, std::memory_order_release);
+    }
+
+    /// `ptr` must be unreachable for the readers which enter from now on.
+    void retire(void * ptr, size_t bytes)
+    {
+        retired.push_back(Retired{ptr, bytes, global_epoch.fetch_add(1)});
+    }
+
+    /// Call `free_func(ptr, bytes)` for every retired piece no reader can see any more.
+    template <typename FreeFunc>
+    void reclaim(FreeFunc && free_func)
+    {
+        uint64_t min_epoch = minActiveEpoch();
+        auto it = std::partition(retired.begin(), retired.end(), [&](const Retired & r) { return r.epoch >= min_epoch; });
+        for (auto cur = it; cur != retired.end(); ++cur)
+            free_func(cur->ptr, cur->bytes);
+        retired.erase(it, retired.end());
+    }
+
+    /// Free everything, when there are no readers any more.
+    template <typename FreeFunc>
+    void reclaimAll(FreeFunc && free_func)
+    {
+        for (const Retired & r : retired)
+            free_func(r.ptr, r.bytes);
+        retired.clear();
+    }
+};
+
+class EpochGuard
+{
+    EpochDomain & domain;
+
+public:
+    explicit EpochGuard(EpochDomain & domain_) : domain(domain_) { domain.enter(); }
+    ~EpochGuard() { domain.exit(); }
+
+    EpochGuard(const EpochGuard &) = delete;
+    EpochGuard & operator=(const EpochGuard &) = delete;
+};
+
+}
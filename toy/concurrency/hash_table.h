@@ -1,11 +1,17 @@
 #include "alloc.h"
+#include "epoch.h"
 #include <cstring>
+#include <cstdint>
 
+#include <algorithm>
 #include <condition_variable>
 #include <mutex>
 #include <atomic>
 #include <iostream>
 #include  <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace toy {
 
@@ -54,6 +60,33 @@ struct HashTableGrower
         size_degree += size_degree >= 23 ? 1 : 2;
     }
 
+    /// How many cells of the old buffer one thread moves at a time. Zero means the whole buffer is rehashed by the resizer.
+    static constexpr size_t migrate_chunk_size = 0;
+
+    /// On how many threads the resizer rehashes the whole buffer.
+    static constexpr size_t resize_threads = 1;
+};
+
+/** The grower for a table which publishes the new buffer right away on resize.
+  * The cells of the old buffer are moved over chunk by chunk by every thread touching the table,
+  *  so no thread has to wait for a whole rehash.
+  */
+template <size_t initial_size_degree = 8, size_t chunk_size = 4096>
+struct IncrementalHashTableGrower : public HashTableGrower<initial_size_degree>
+{
+    static constexpr size_t migrate_chunk_size = chunk_size;
+};
+
+/** The grower for a table whose resizer rehashes the old buffer on `threads` threads while the table is stopped.
+  * The old buffer is split at empty cells, so every chain is moved by a single thread in the order of the serial rehash,
+  *  and the new buffer is the same as with one thread.
+  */
+template <size_t threads, size_t initial_size_degree = 8>
+struct ParallelHashTableGrower : public HashTableGrower<initial_size_degree>
+{
+    static_assert(threads > 0, "the resize needs a thread");
+
+    static constexpr size_t resize_threads = threads;
 };
 
 template <typename Key, typename TMapped, typename Hash_ = std::hash<Key>>
@@ -71,8 +104,17 @@ struct HashMapCell
 
     std::atomic_bool inserting = false;
 
+    /// An erased cell keeps its key, so that the collision resolution chains through it stay intact.
+    bool deleted = false;
+
+    /// Whether `findCell` can claim this cell without taking its mutex.
+    static constexpr bool lock_free = false;
+
+    /// The number of high key bits the cell takes for its state, the keys using them can't be inserted.
+    static constexpr size_t state_bits = 0;
+
     HashMapCell() {}
-    HashMapCell(const value_type & value_) : value(value_), inserting(false) {}
+    HashMapCell(const value_type & value_) : value(value_), inserting(false), deleted(false) {}
 
     value_type & getValue() { 
         std::shared_lock<std::shared_mutex> lock(mutex_);
@@ -103,7 +145,13 @@ struct HashMapCell
 
     static bool isZero(const Key & key) { return ZeroTraits::check(key); }
 
-    bool isInsertable() const {return isZero();}
+    /// Not a live element, only used to skip the cell while iterating. New keys are claimed only in zero cells.
+    bool isInsertable() const {return isZero() || isDeleted();}
+
+    bool isDeleted() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        return deleted;
+    }
 
     bool getInsertLock() {
         std::unique_lock<std::shared_mutex> lock(mutex_);
@@ -114,6 +162,25 @@ struct HashMapCell
         return false;
     }
 
+    /// Mark the live element as deleted. Fails if it is deleted already or still being inserted.
+    bool tryErase() {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (deleted || inserting.load() || ZeroTraits::check(value.first))
+            return false;
+        deleted = true;
+        return true;
+    }
+
+    /// Take the deleted cell of the same key for writing, like `getInsertLock` does for an empty one.
+    bool tryRevive() {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (!deleted)
+            return false;
+        deleted = false;
+        inserting.store(true);
+        return true;
+    }
+
     void setValue(const value_type & value_) {
         new (&value) value_type(value_);
         inserting.store(false);
@@ -123,23 +190,376 @@ struct HashMapCell
     void setZero() {
         std::unique_lock<std::shared_mutex> lock(mutex_);
         ZeroTraits::set(value.first);
+        deleted = false;
+    }
+};
+
+/** A cell whose readers take no lock. The version counter is odd while a writer changes the cell,
+  *  a reader copies what it needs and retries if the version has changed meanwhile.
+  * Writers take the cell by moving the version from even to odd with a CAS, so the counter is the write lock too.
+  * The key and the mapped value are copied while they may be written, so both must be trivially copyable.
+  */
+template <typename Key, typename TMapped, typename Hash_ = std::hash<Key>>
+struct SeqLockHashMapCell
+{
+    static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<TMapped>,
+                  "seqlock cell needs trivially copyable keys and values");
+
+    using Mapped = TMapped;
+
+    using Hash = Hash_;
+
+    using value_type = std::pair<Key, Mapped>;
+
+    value_type value;
+
+    mutable std::atomic<uint32_t> version = 0;
+
+    /// An erased cell keeps its key, so that the collision resolution chains through it stay intact.
+    bool deleted = false;
+
+    static constexpr bool lock_free = false;
+
+    static constexpr size_t state_bits = 0;
+
+    SeqLockHashMapCell() {}
+    SeqLockHashMapCell(const value_type & value_) : value(value_), version(0), deleted(false) {}
+
+    /// Call `func` on a consistent state of the value, without taking any lock.
+    template <typename Func>
+    auto read(Func && func) const
+    {
+        for (;;) {
+            uint32_t begin_version = version.load(std::memory_order_acquire);
+            if (begin_version & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            auto res = func(value);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (version.load(std::memory_order_relaxed) == begin_version)
+                return res;
+        }
+    }
+
+    /// An inserted value is not changed any more, so it can be referenced once its writer is done.
+    value_type & getValue() {
+        while (version.load(std::memory_order_acquire) & 1)
+            std::this_thread::yield();
+        return value;
+    }
+    const value_type & getValue() const {
+        while (version.load(std::memory_order_acquire) & 1)
+            std::this_thread::yield();
+        return value;
+    }
+
+    static Key & getKey(value_type & value) { return value.first; }
+    static const Key & getKey(const value_type & value) { return value.first; }
+
+    bool keyEquals(const Key & key_) const {
+        return read([&](const value_type & v) { return v.first == key_; });
+    }
+
+    size_t getHash(const Hash & hash) const {
+        return hash(read([](const value_type & v) { return v.first; }));
+    }
+
+    bool isZero() const {
+        return read([](const value_type & v) { return ZeroTraits::check(v.first); });
+    }
+
+    static bool isZero(const Key & key) { return ZeroTraits::check(key); }
+
+    /// Not a live element, only used to skip the cell while iterating. New keys are claimed only in zero cells.
+    bool isInsertable() const {return isZero() || isDeleted();}
+
+    bool isDeleted() const {
+        return read([this](const value_type &) { return deleted; });
+    }
+
+    /// Take the empty cell for writing. If some writer changed the version after it has been loaded, the cell is not empty any more.
+    bool getInsertLock() {
+        uint32_t cur_version = version.load(std::memory_order_acquire);
+        if ((cur_version & 1) || !ZeroTraits::check(value.first))
+            return false;
+        return version.compare_exchange_strong(cur_version, cur_version + 1, std::memory_order_acquire);
+    }
+
+    /// Take the write lock, that is move the version from even to odd.
+    void lockWrite() {
+        for (;;) {
+            uint32_t cur_version = version.load(std::memory_order_relaxed);
+            if (!(cur_version & 1) && version.compare_exchange_weak(cur_version, cur_version + 1, std::memory_order_acquire))
+                return;
+            std::this_thread::yield();
+        }
+    }
+
+    void unlockWrite() {
+        version.fetch_add(1, std::memory_order_release);
+    }
+
+    /// Mark the live element as deleted. Fails if it is deleted already or still being inserted.
+    bool tryErase() {
+        uint32_t cur_version = version.load(std::memory_order_acquire);
+        if ((cur_version & 1) || deleted || ZeroTraits::check(value.first))
+            return false;
+        if (!version.compare_exchange_strong(cur_version, cur_version + 1, std::memory_order_acquire))
+            return false;
+        deleted = true;
+        unlockWrite();
+        return true;
+    }
+
+    /// Take the deleted cell of the same key for writing, like `getInsertLock` does for an empty one.
+    bool tryRevive() {
+        lockWrite();
+        if (!deleted) {
+            unlockWrite();
+            return false;
+        }
+        deleted = false;
+        return true;
+    }
+
+    /// Must be called after `getInsertLock`, releases the cell.
+    void setValue(const value_type & value_) {
+        value = value_;
+        version.fetch_add(1, std::memory_order_release);
+    }
+
+    /// Set the key value to zero.
+    void setZero() {
+        lockWrite();
+        ZeroTraits::set(value.first);
+        deleted = false;
+        unlockWrite();
+    }
+};
+
+/** A cell for trivially copyable keys (like `int`) which has no mutex at all.
+  * The key slot is claimed by a CAS from zero, so probing never blocks on other threads.
+  * The mapped value is written after the key is claimed and is published by `state`.
+  */
+template <typename Key, typename TMapped, typename Hash_ = std::hash<Key>>
+struct LockFreeHashMapCell
+{
+    static_assert(std::is_trivially_copyable_v<Key> && sizeof(Key) <= sizeof(uint64_t),
+                  "lock free cell needs a trivially copyable key which fits into a CAS");
+
+    using Mapped = TMapped;
+
+    using Hash = Hash_;
+
+    using value_type = std::pair<Key, Mapped>;
+
+    value_type value;
+
+    /// A claimed cell is `writing` until the mapped value is set. An erased cell keeps its key.
+    enum State : uint8_t { writing = 0, ready = 1, deleted = 2 };
+
+    std::atomic<uint8_t> state = writing;
+
+    static constexpr bool lock_free = true;
+
+    static constexpr size_t state_bits = 0;
+
+    LockFreeHashMapCell() {}
+    LockFreeHashMapCell(const value_type & value_) : value(value_), state(ready) {}
+
+    /// The key may be visible before the mapped value, wait for the claiming thread to finish.
+    value_type & getValue() {
+        while (state.load(std::memory_order_acquire) == writing)
+            std::this_thread::yield();
+        return value;
+    }
+    const value_type & getValue() const {
+        while (state.load(std::memory_order_acquire) == writing)
+            std::this_thread::yield();
+        return value;
+    }
+
+    static Key & getKey(value_type & value) { return value.first; }
+    static const Key & getKey(const value_type & value) { return value.first; }
+
+    Key loadKey() const {
+        Key key;
+        __atomic_load(&value.first, &key, __ATOMIC_ACQUIRE);
+        return key;
+    }
+
+    bool keyEquals(const Key & key_) const { return loadKey() == key_; }
+
+    size_t getHash(const Hash & hash) const { return hash(loadKey()); }
+
+    bool isZero() const { return ZeroTraits::check(loadKey()); }
+
+    static bool isZero(const Key & key) { return ZeroTraits::check(key); }
+
+    /// Not a live element, only used to skip the cell while iterating. New keys are claimed only in zero cells.
+    bool isInsertable() const {return isZero() || isDeleted();}
+
+    bool isDeleted() const { return state.load(std::memory_order_acquire) == deleted; }
+
+    /// Try to move the key slot from `expected` (zero) to `key`. On failure `expected` holds the key of the winner.
+    bool tryClaim(Key & expected, const Key & key) {
+        return __atomic_compare_exchange(&value.first, &expected, &key, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+
+    /// Mark the live element as deleted. Fails if it is deleted already or still being inserted.
+    bool tryErase() {
+        uint8_t expected = ready;
+        return state.compare_exchange_strong(expected, deleted, std::memory_order_acq_rel);
+    }
+
+    /// Take the deleted cell of the same key for writing, `setValue` publishes it again.
+    bool tryRevive() {
+        uint8_t expected = deleted;
+        return state.compare_exchange_strong(expected, writing, std::memory_order_acq_rel);
+    }
+
+    void setValue(const value_type & value_) {
+        value.second = value_.second;
+        __atomic_store(&value.first, &value_.first, __ATOMIC_RELEASE);
+        state.store(ready, std::memory_order_release);
+    }
+
+    /// Set the key value to zero.
+    void setZero() {
+        Key zero;
+        ZeroTraits::set(zero);
+        state.store(writing, std::memory_order_relaxed);
+        __atomic_store(&value.first, &zero, __ATOMIC_RELEASE);
+    }
+};
+
+/** A lock free cell with nothing but the value, `CompactHashMapCell<int, int>` takes 8 bytes, so 8 cells share a cache line.
+  * The state lives in the two high bits of the key: `inserting_bit` while the mapped value is being written, `deleted_bit` once
+  *  the key is erased, none for a published element. The keys must not use these bits, which is checked on insert.
+  */
+template <typename Key, typename TMapped, typename Hash_ = std::hash<Key>>
+struct CompactHashMapCell
+{
+    static_assert(std::is_integral_v<Key>, "compact cell keeps its state in the bits of an integer key");
+
+    using Mapped = TMapped;
+
+    using Hash = Hash_;
+
+    using value_type = std::pair<Key, Mapped>;
+
+    using UnsignedKey = std::make_unsigned_t<Key>;
+
+    static constexpr UnsignedKey inserting_bit = UnsignedKey(1) << (sizeof(Key) * 8 - 1);
+    static constexpr UnsignedKey deleted_bit = UnsignedKey(1) << (sizeof(Key) * 8 - 2);
+    static constexpr UnsignedKey state_mask = inserting_bit | deleted_bit;
+
+    value_type value;
+
+    static constexpr bool lock_free = true;
+
+    static constexpr size_t state_bits = 2;
+
+    CompactHashMapCell() {}
+    CompactHashMapCell(const value_type & value_) : value(value_) {}
+
+    static bool isValidKey(const Key & key) { return !(UnsignedKey(key) & state_mask); }
+
+    /// The key word with the state bits.
+    UnsignedKey loadWord() const { return UnsignedKey(__atomic_load_n(&value.first, __ATOMIC_ACQUIRE)); }
+
+    bool casWord(UnsignedKey & expected, UnsignedKey desired) {
+        return __atomic_compare_exchange_n(reinterpret_cast<UnsignedKey *>(&value.first), &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    }
+
+    /// The key may be visible before the mapped value, wait for the claiming thread to finish.
+    value_type & getValue() {
+        while (loadWord() & inserting_bit)
+            std::this_thread::yield();
+        return value;
+    }
+    const value_type & getValue() const {
+        while (loadWord() & inserting_bit)
+            std::this_thread::yield();
+        return value;
+    }
+
+    static Key & getKey(value_type & value) { return value.first; }
+    static const Key & getKey(const value_type & value) { return value.first; }
+
+    Key loadKey() const { return Key(loadWord() & ~state_mask); }
+
+    bool keyEquals(const Key & key_) const { return loadKey() == key_; }
+
+    size_t getHash(const Hash & hash) const { return hash(loadKey()); }
+
+    bool isZero() const { return loadWord() == 0; }
+
+    static bool isZero(const Key & key) { return ZeroTraits::check(key); }
+
+    /// Not a live element, only used to skip the cell while iterating. New keys are claimed only in zero cells.
+    bool isInsertable() const {return isZero() || isDeleted();}
+
+    bool isDeleted() const { return loadWord() & deleted_bit; }
+
+    /// Try to move the key slot from `expected` (zero) to `key`. On failure `expected` holds the key of the winner, without the state.
+    bool tryClaim(Key & expected, const Key & key) {
+        UnsignedKey word = UnsignedKey(expected);
+        if (casWord(word, UnsignedKey(key) | inserting_bit))
+            return true;
+        expected = Key(word & ~state_mask);
+        return false;
+    }
+
+    /// Mark the live element as deleted. Fails if it is deleted already or still being inserted.
+    bool tryErase() {
+        UnsignedKey word = loadWord();
+        while (!(word & state_mask))
+            if (casWord(word, word | deleted_bit))
+                return true;
+        return false;
+    }
+
+    /// Take the deleted cell of the same key for writing, `setValue` publishes it again.
+    bool tryRevive() {
+        UnsignedKey word = loadWord();
+        while (word & deleted_bit)
+            if (casWord(word, (word & ~state_mask) | inserting_bit))
+                return true;
+        return false;
+    }
+
+    /// Publishing the key without the state bits is what makes the element visible.
+    void setValue(const value_type & value_) {
+        value.second = value_.second;
+        __atomic_store_n(&value.first, value_.first, __ATOMIC_RELEASE);
+    }
+
+    /// Set the key value to zero.
+    void setZero() {
+        __atomic_store_n(&value.first, Key(0), __ATOMIC_RELEASE);
     }
 };
 
-template <class Container_, typename Cell, bool is_const>
+/** The iterator walks the buffer it was taken from, not whatever buffer the table has now. A resize leaves the old buffer
+  *  as it is until it is reclaimed, so under `readGuard` the iteration stays within a valid buffer and sees the keys
+  *  as of the switch. The end iterator holds no cell, so that it does not change when a resize switches the buffer.
+  */
+template <typename Cell, bool is_const>
 class iterator_base
 {
-    using Container = std::conditional_t<is_const, const Container_, Container_>;
     using cell_type = std::conditional_t<is_const, const Cell, Cell>;
 
-    using Self = iterator_base<Container_, Cell, is_const>;
+    using Self = iterator_base<Cell, is_const>;
 
-    Container * container;
     cell_type * ptr;
+    cell_type * buf_begin;
+    cell_type * buf_end;
 
 public:
     iterator_base() {}
-    iterator_base(Container * container_, cell_type * ptr_) : container(container_), ptr(ptr_) {}
+    iterator_base(cell_type * ptr_, cell_type * buf_begin_, cell_type * buf_end_) : ptr(ptr_), buf_begin(buf_begin_), buf_end(buf_end_) {}
 
     bool operator== (const iterator_base & rhs) const { return ptr == rhs.ptr; }
     bool operator!= (const iterator_base & rhs) const { return ptr != rhs.ptr; }
@@ -147,13 +567,16 @@ public:
     Self & operator++()
     {
         if (ptr->isZero())
-            ptr = container->buf;
+            ptr = buf_begin;
         else
             ++ptr;
 
-        while (ptr < container->buf + container->grower.bufSize() && ptr->isInsertable())
+        while (ptr < buf_end && ptr->isInsertable())
             ++ptr;
 
+        if (ptr == buf_end)
+            ptr = nullptr;
+
         return (*this);
     }
 
@@ -178,26 +601,23 @@ class HashTable : public ZeroStorage<Cell>, public Allocator
 
 
 public:
-    class iterator : public iterator_base<Self, Cell, false> {
+    class iterator : public iterator_base<Cell, false> {
     public:
-        using iterator_base<Self, Cell, false>::iterator_base;
+        using iterator_base<Cell, false>::iterator_base;
     };
 
-    class const_iterator : public iterator_base<Self, Cell, true> {
+    class const_iterator : public iterator_base<Cell, true> {
     public:
-        using iterator_base<Self, Cell, true>::iterator_base;
+        using iterator_base<Cell, true>::iterator_base;
     };
 
-    friend class iterator;
-    friend class const_iterator;
-
 private:
-    void reinsert(const Cell & x, size_t hash_value, Cell * cur_buf)
+    void reinsert(const Cell & x, size_t hash_value, Cell * cur_buf, const Grower & cur_grower)
     {
-        size_t place_value = grower.place(hash_value);
+        size_t place_value = cur_grower.place(hash_value);
 
-        /// Compute a new location, taking into account the collision resolution chain.
-        auto [ result_place_value,  empty] = findCell<false>(Cell::getKey(x.getValue()), place_value, cur_buf);
+        /// Compute a new location, taking into account the collision resolution chain. The cell is claimed, as `setValue` expects.
+        auto [ result_place_value,  empty] = findCell<true>(Cell::getKey(x.getValue()), place_value, cur_buf, cur_grower);
 
         /// If the item remains in its place in the old collision resolution chain.
         if (!empty)
@@ -210,18 +630,200 @@ private:
 
     std::condition_variable cv;
 
+    /** Threads inside the table only touch `active_thread` and `resizing` on the fast path, `resize_mutex` is taken only
+      *  when a resize is in progress. The resizer raises `resizing` first and then waits for `active_thread`
+      *  to drop to zero, so a thread either sees the flag or is seen by the resizer.
+      * Inserters always enter, readers only do in the incremental mode, where `buf` and `grower` are switched under it.
+      */
+    void enterTable()
+    {
+        for (;;) {
+            active_thread.fetch_add(1);
+            if (!resizing.load())
+                return;
+            exitTable();
+
+            std::unique_lock<std::mutex> lock(resize_mutex);
+            cv.wait(lock, [this]{return !resizing.load();});
+        }
+    }
+
+    void exitTable()
+    {
+        active_thread.fetch_sub(1);
+        if (resizing.load()) {
+            std::lock_guard<std::mutex> lock(resize_mutex);
+            cv.notify_all();
+        }
+    }
+
+    static constexpr bool incremental = Grower::migrate_chunk_size != 0;
+
+    /// Copy a cell of the old buffer into `buf` unless some other thread has already done it.
+    /// A deleted cell of the key in `buf` means that the key was moved and erased since, so it must not come back.
+    void migrateCell(Cell & x)
+    {
+        const Key & key = Cell::getKey(x.getValue());
+        auto [place, empty] = findCell<true>(key, grower.place(x.getHash(hash)), buf, grower);
+        if (empty)
+            buf[place].setValue(x.getValue());
+    }
+
+    /// Move one chunk of the old buffer, if there is anything left to claim. Must be called inside the table.
+    void helpMigrate()
+    {
+        Cell * old = old_buf.load();
+        if (!old)
+            return;
+
+        size_t old_size = old_grower.bufSize();
+        size_t begin = next_migrate.fetch_add(Grower::migrate_chunk_size);
+        if (begin >= old_size)
+            return;
+
+        size_t end = std::min(begin + Grower::migrate_chunk_size, old_size);
+        for (size_t i = begin; i < end; ++i)
+            if (!old[i].isZero() && !old[i].isDeleted())
+                migrateCell(old[i]);
+
+        /// The old buffer is only retired, readers that have loaded it may still probe it.
+        if (migrated.fetch_add(end - begin) + (end - begin) == old_size)
+            old_buf.store(nullptr);
+    }
+
+    void finishMigration()
+    {
+        while (old_buf.load()) {
+            helpMigrate();
+            if (next_migrate.load() >= old_grower.bufSize())
+                std::this_thread::yield();
+        }
+    }
+
+    /** The old buffer is never modified during the migration, so a key is in the table if it is found either in `buf` or in `old`.
+      * `old` must be loaded before probing `buf`: once `old_buf` is reset every old key is already in `buf`.
+      * The returned cell may be deleted, a deleted cell in `buf` hides the old one.
+      */
+    Cell * findInMigration(const Key & x, size_t hash_value, Cell * old)
+    {
+        auto [place, empty] = findCell<false>(x, grower.place(hash_value), buf, grower);
+        if (!empty)
+            return &buf[place];
+        if (!old)
+            return nullptr;
+
+        std::tie(place, empty) = findCell<false>(x, old_grower.place(hash_value), old, old_grower);
+        return empty ? nullptr : &old[place];
+    }
+
+    /// Publish the new buffer and let everybody move the old cells over.
+    void startMigration(const Grower & new_grower)
+    {
+        Cell * new_buf = reinterpret_cast<Cell *>(Allocator::alloc(new_grower.bufSize() * sizeof(Cell)));
+
+        /// The previous migration is finished, but the readers may still hold its old buffer.
+        if (migrated_buf)
+            retireBuffer(migrated_buf, old_grower.bufSize() * sizeof(Cell));
+        migrated_buf = buf.load();
+        old_grower = grower;
+        next_migrate.store(0);
+        migrated.store(0);
+        old_buf.store(buf.load());
+
+        grower = new_grower;
+        buf.store(new_buf);
+
+        /// The deleted cells are not moved.
+        deleted_cells.store(0);
+    }
+
+    /// The erased cells are not reused by other keys, but they take the place in the buffer until the next resize.
+    bool overflow() const
+    {
+        return grower.overflow(size.load() + deleted_cells.load());
+    }
+
+    /// A resize only drops the deleted cells if there are many of them.
+    Grower grownGrower() const
+    {
+        Grower new_grower = grower;
+        if (grower.overflow(size.load() * 2))
+            new_grower.increaseSize();
+        return new_grower;
+    }
+
+    /// The cells a thread of the parallel resize takes at least, small tables are rehashed on fewer threads.
+    static constexpr size_t min_resize_cells_per_thread = 1 << 16;
+
+    void rehashRange(const Cell * old, size_t begin, size_t end, Cell * new_buf, const Grower & new_grower)
+    {
+        for (size_t i = begin; i < end; ++i)
+            if (!old[i].isZero() && !old[i].isDeleted())
+                reinsert(old[i], old[i].getHash(hash), new_buf, new_grower);
+    }
+
+    /** Rehash `old` into `new_buf` on up to `Grower::resize_threads` threads.
+      * With linear probing the cells of a chain of the old buffer land only in the images of that chain in the new buffer,
+      *  so the ranges which start at an empty cell are rehashed independently. The only chain which crosses the ranges is the one
+      *  wrapping around the end of the old buffer, its tail is taken by the first thread after the first range, in the serial order.
+      */
+    void rehashAll(const Cell * old, size_t old_size, Cell * new_buf, const Grower & new_grower)
+    {
+        size_t num_threads = std::max<size_t>(1, std::min(Grower::resize_threads, old_size / min_resize_cells_per_thread));
+
+        std::vector<size_t> bounds(num_threads + 1, old_size);
+        bounds[0] = 0;
+        for (size_t t = 1; t < num_threads; ++t) {
+            size_t bound = std::max(old_size / num_threads * t, bounds[t - 1]);
+            while (bound < old_size && !old[bound].isZero())
+                ++bound;
+            bounds[t] = bound;
+        }
+
+        /// The empty cell before the chain which wraps around.
+        size_t tail = old_size;
+        if (num_threads > 1)
+            while (tail > bounds[num_threads - 1] && !old[tail - 1].isZero())
+                --tail;
+
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < num_threads; ++t)
+            workers.emplace_back([&, t] { rehashRange(old, bounds[t], t + 1 == num_threads ? tail : bounds[t + 1], new_buf, new_grower); });
+        rehashRange(old, 0, bounds[1], new_buf, new_grower);
+        rehashRange(old, tail, old_size, new_buf, new_grower);
+        for (auto & worker : workers)
+            worker.join();
+    }
+
     bool resize()
     {
         std::unique_lock<std::mutex> lock(resize_mutex);
 
-        cv.wait(lock, [this]{return insert_thread.load() == 0;});
-
-        size_t old_size = grower.bufSize();
+        /// `cv.wait` below releases the mutex, so another resizer may be in the middle of its work.
+        cv.wait(lock, [this]{return !resizing.load();});
 
-        if (!grower.overflow(size)) {
+        if (!overflow()) {
             return false;
         }
 
+        /// The previous migration must be done before `old_buf` can be reused. Nobody can switch the buffer while we hold the mutex.
+        if constexpr (incremental)
+            finishMigration();
+
+        resizing.store(true);
+        cv.wait(lock, [this]{return active_thread.load() == 0;});
+
+        if constexpr (incremental) {
+            startMigration(grownGrower());
+
+            resizing.store(false);
+            cv.notify_all();
+
+            return true;
+        }
+
+        size_t old_size = grower.bufSize();
+
         //std::cout<<"resize!"<<std::endl;
 
         /** In case of exception for the object to remain in the correct state,
@@ -229,9 +831,7 @@ private:
           *  is postponed for a moment after a real buffer change.
           * The temporary variable `new_grower` is used to determine the new size.
           */
-        Grower new_grower = grower;
-
-        new_grower.increaseSize();
+        Grower new_grower = grownGrower();
 
         /// Expand the space.
         Cell* new_buf = reinterpret_cast<Cell *>(Allocator::alloc(new_grower.bufSize() * sizeof(Cell)));
@@ -240,16 +840,20 @@ private:
           * The element can stay in place, or move to a new location "on the right",
           *  or move to the left of the collision resolution chain, because the elements to the left of it have been moved to the new "right" location.
           */
-        //std::cout<<"before insert\n";
-        size_t i = 0;
-       // std::cout<<"old: "<<old_size<<std::endl;
         Cell * old_buf = buf.load();
-        for (; i < old_size; ++i)
-            if (!old_buf[i].isZero())
-                reinsert(old_buf[i], old_buf[i].getHash(hash), new_buf);
+        rehashAll(old_buf, old_size, new_buf, new_grower);
+        deleted_cells.store(0);
+
+        /// The readers don't enter the table, they keep probing the old buffer until it is reclaimed.
+        size_t old_bytes = getBufferSizeInBytes();
+        buf_version.fetch_add(1);
         buf.store(new_buf);
-        Allocator::free(old_buf, getBufferSizeInBytes());
         grower = (new_grower);
+        buf_version.fetch_add(1);
+        retireBuffer(old_buf, old_bytes);
+
+        resizing.store(false);
+        cv.notify_all();
 
         return true;
     }
@@ -264,24 +868,90 @@ private:
 
     Hash hash;
 
-    std::atomic_int insert_thread;
+    std::atomic_int active_thread;
+
+    std::atomic_bool resizing;
+
+    /// The state of the incremental migration. `old_buf` is null when there is nothing to move.
+    std::atomic<Cell *> old_buf;
+    Grower old_grower;
+    std::atomic<size_t> next_migrate;
+    std::atomic<size_t> migrated;
+
+    /// The old buffer of the last migration of the incremental mode, it is retired by the next resize.
+    Cell * migrated_buf = nullptr;
 
+    /// The buffers replaced by resizes wait here until no reader can see them.
+    mutable EpochDomain epochs;
+
+    /// Odd while `buf` and `grower` are being switched, so that a reader can load a matching pair.
+    std::atomic<uint64_t> buf_version{0};
+
+    /// Must be called under `resize_mutex`.
+    void retireBuffer(Cell * old, size_t bytes)
+    {
+        epochs.retire(old, bytes);
+        epochs.reclaim([this](void * ptr, size_t n) { Allocator::free(ptr, n); });
+    }
+
+    /// The current buffer and its grower. The buffer stays valid while the caller holds an epoch guard.
+    std::pair<Cell *, Grower> loadBuffer() const
+    {
+        for (;;) {
+            uint64_t begin_version = buf_version.load(std::memory_order_acquire);
+            if (begin_version & 1) {
+                std::this_thread::yield();
+                continue;
+            }
+            Cell * cur_buf = buf.load();
+            Grower cur_grower = grower;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (buf_version.load(std::memory_order_relaxed) == begin_version)
+                return std::make_pair(cur_buf, cur_grower);
+        }
+    }
+
+    /// The number of live elements.
     std::atomic_int  size;
 
+    /// The number of erased cells which still hold their keys in `buf`.
+    std::atomic_int  deleted_cells;
+
     using value_type = typename Cell::value_type;
 
-    void emplaceNonZero(const value_type & value, iterator & it, bool & insert, size_t hash_value) {
-        {
-            std::lock_guard<std::mutex> lock(resize_mutex);
-            insert_thread.fetch_add(1);
+    /// The key may still be in the old buffer only, move it first so that it is found in `buf`. Must be called inside the table.
+    void migrateKey(const Key & key, size_t hash_value)
+    {
+        if constexpr (incremental) {
+            if (Cell * old = old_buf.load()) {
+                helpMigrate();
+                auto [old_place, old_empty] = findCell<false>(key, old_grower.place(hash_value), old, old_grower);
+                if (!old_empty && !old[old_place].isDeleted()) {
+                    migrateCell(old[old_place]);
+                    /// Another thread may still be writing its copy. The key exists, so an erase must not take it for an unfinished insert.
+                    auto [place, empty] = findCell<false>(key, grower.place(hash_value), buf, grower);
+                    if (!empty)
+                        buf[place].getValue();
+                }
+            }
         }
+    }
+
+    void emplaceNonZero(const value_type & value, iterator & it, bool & insert, size_t hash_value) {
+        enterTable();
         const Key & key = Cell::getKey(value);
-        auto [place,  empty] = findCell<true>(key, grower.place(hash_value), buf);
-        it = iterator(this, &buf[place]);
+        migrateKey(key, hash_value);
+        auto [place,  empty] = findCell<true>(key, grower.place(hash_value), buf, grower);
+        it = iteratorIn(&buf[place], buf, grower);
         if (!empty) {
-            insert = false;
-            insert_thread.fetch_sub(1);
-            cv.notify_all();
+            /// The key was erased, its cell is taken back rather than a new one. If another thread revives it first, the key is there.
+            insert = buf[place].tryRevive();
+            if (insert) {
+                buf[place].setValue(value);
+                size.fetch_add(1);
+                deleted_cells.fetch_sub(1);
+            }
+            exitTable();
             return;
         }
         buf[place].setValue(value);
@@ -289,10 +959,9 @@ private:
 
         size.fetch_add(1);
 
-        insert_thread.fetch_sub(1);
-        cv.notify_all();
+        exitTable();
         //std::cout<<"size: "<<size<<std::endl;
-        if (grower.overflow(size)) {
+        if (overflow()) {
             //std::cout<<"try resize\n";
             if(resize())
                 it = find(key);
@@ -307,47 +976,101 @@ private:
         }
         if (this->has_zero) {
             insert = false;
-            it = iterator(this, &this->zero_storage);
+            it = iteratorToZero();
         } else {
             insert = true;
             this->has_zero = true;
             new(&this->zero_storage) Cell(value);
-            it = iterator(this, &this->zero_storage);
+            it = iteratorToZero();
         }
         return true;
     }
 
     /// Find a cell with the same key or an empty cell, starting from the specified position and further along the collision resolution chain.
     template<bool insert>
-    std::pair<size_t, bool> findCell(const Key & x, size_t place_value, Cell * cur_buf) const
+    std::pair<size_t, bool> findCell(const Key & x, size_t place_value, Cell * cur_buf, const Grower & cur_grower) const
     {
-        for (;;) {
-            while (!cur_buf[place_value].isZero() && !cur_buf[place_value].keyEquals(x))
-            {
-                place_value = grower.next(place_value);
-//                std::cout<<place_value<<std::endl;
+        if constexpr (Cell::lock_free) {
+            for (;;) {
+                Key cur = cur_buf[place_value].loadKey();
+                if (Cell::isZero(cur)) {
+                    if constexpr (!insert)
+                        return std::make_pair(place_value, true);
+                    if (cur_buf[place_value].tryClaim(cur, x))
+                        return std::make_pair(place_value, true);
+                    /// Lost the race, `cur` is the key of the winner now.
+                }
+                if (cur == x)
+                    return std::make_pair(place_value, false);
+                place_value = cur_grower.next(place_value);
             }
+        } else {
+            for (;;) {
+                /// The cell is judged by one look: another thread may claim an empty cell right after it is seen, and reading
+                ///  `isZero` once more would then take the key of that thread for ours.
+                bool empty;
+                while (!(empty = cur_buf[place_value].isZero()) && !cur_buf[place_value].keyEquals(x))
+                    place_value = cur_grower.next(place_value);
+
+                if constexpr (insert) {
+                    /// Another thread is taking the cell, maybe for the same key, so look at the cell again once it is done.
+                    if (empty && !cur_buf[place_value].getInsertLock()) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                }
 
-            bool empty = cur_buf[place_value].isZero();
+                //std::cout<<"return: "<< place_value<<std::endl;
 
-            if constexpr (insert) {
-                if (empty && !cur_buf[place_value].getInsertLock()) {
-                    //std::cout<<"conflict\n";
-                    place_value = grower.next(place_value);
-                    continue;
-                }
+                return std::make_pair(place_value, empty);
             }
+        }
+    }
 
-            //std::cout<<"return: "<< place_value<<std::endl;
+    const_iterator iteratorIn(const Cell * ptr, const Cell * cur_buf, const Grower & cur_grower) const
+    {
+        return const_iterator(ptr, cur_buf, cur_buf + cur_grower.bufSize());
+    }
+    iterator iteratorIn(Cell * ptr, Cell * cur_buf, const Grower & cur_grower)
+    {
+        return iterator(ptr, cur_buf, cur_buf + cur_grower.bufSize());
+    }
 
-            return std::make_pair(place_value, empty);
-        }
+    /// The zero key is iterated first, then the buffer.
+    const_iterator iteratorToZero() const
+    {
+        auto [cur_buf, cur_grower] = iterationBuffer();
+        return iteratorIn(&this->zero_storage, cur_buf, cur_grower);
+    }
+    iterator iteratorToZero()
+    {
+        auto [cur_buf, cur_grower] = iterationBuffer();
+        return iteratorIn(&this->zero_storage, cur_buf, cur_grower);
     }
 
-    const_iterator iteratorTo(const Cell * ptr) const { return const_iterator(this, ptr); }
-    iterator iteratorTo(Cell * ptr)                   { return iterator(this, ptr); }
-    const_iterator iteratorToZero() const             { return iteratorTo(&this->zero_storage); }
-    iterator iteratorToZero()                         { return iteratorTo(&this->zero_storage); }
+    /// The buffer of a cell found by `findInMigration`, the new one or the old one. Must be called inside the table.
+    std::pair<Cell *, Grower> bufferOf(const Cell * cell, Cell * old) const
+    {
+        if (old && cell >= old && cell < old + old_grower.bufSize())
+            return std::make_pair(old, old_grower);
+        return std::make_pair(buf.load(), grower);
+    }
+
+    /** The buffer to iterate over. In the incremental mode the migration is finished first and the buffer is taken inside the table,
+      *  so that it holds all the keys: a later migration only copies them out of it.
+      */
+    std::pair<Cell *, Grower> iterationBuffer() const
+    {
+        if constexpr (incremental) {
+            Self * self = const_cast<Self *>(this);
+            self->enterTable();
+            self->finishMigration();
+            std::pair<Cell *, Grower> res(buf.load(), grower);
+            self->exitTable();
+            return res;
+        }
+        return loadBuffer();
+    }
 
     void alloc(const Grower & new_grower)
     {
@@ -367,15 +1090,40 @@ public:
     {
         this->has_zero = false;
         size = 0;
-        insert_thread = 0;
+        deleted_cells = 0;
+        active_thread = 0;
+        resizing = false;
+        old_buf = nullptr;
         alloc(grower);
     }
 
+    ~HashTable()
+    {
+        Allocator::free(buf.load(), getBufferSizeInBytes());
+        if (migrated_buf)
+            Allocator::free(migrated_buf, old_grower.bufSize() * sizeof(Cell));
+        epochs.reclaimAll([this](void * ptr, size_t n) { Allocator::free(ptr, n); });
+    }
+
+    /** Lookups protect the buffer only while they probe it. Hold the guard to keep using the returned iterators
+      *  or to iterate while other threads insert. The iteration walks the buffer taken by `begin`, so the keys inserted
+      *  after a resize are not seen. A resize never waits for the guards, it only defers the freeing.
+      */
+    EpochGuard readGuard() const
+    {
+        return EpochGuard(epochs);
+    }
+
     /// Insert a value. In the case of any more complex values, it is better to use the `emplace` function.
     std::pair<iterator, bool> insert_unique(const value_type & x)
     {
         std::pair<iterator, bool> res;
 
+        if constexpr (Cell::state_bits != 0) {
+            if (!Cell::isValidKey(Cell::getKey(x)))
+                throw "key uses the state bits of the cell";
+        }
+
         size_t hash_value = hash(Cell::getKey(x));
         if (!emplaceIfZero(x, res.first, res.second, hash_value))
             emplaceNonZero(x, res.first, res.second, hash_value);
@@ -383,36 +1131,80 @@ public:
         return res;
     }
 
+    /** The cell is marked as deleted, and keeps its key until the next resize, so the probes of other keys still pass it.
+      * Erasers enter the table like inserters, so a resize never copies a cell which is being erased.
+      * A key which is still being inserted by another thread is not erased, as if the erase had happened first.
+      */
     bool erase(const Key & key)
     {
-        throw "";
+        if (Cell::isZero(key)) {
+            bool res = this->has_zero;
+            this->has_zero = false;
+            return res;
+        }
+
+        size_t hash_value = hash(key);
+        enterTable();
+        migrateKey(key, hash_value);
+        auto [place, empty] = findCell<false>(key, grower.place(hash_value), buf, grower);
+        bool res = !empty && buf[place].tryErase();
+        if (res) {
+            size.fetch_sub(1);
+            deleted_cells.fetch_add(1);
+        }
+        exitTable();
+        return res;
     }
 
     iterator find(const Key & x)
     {
-        std::lock_guard<std::mutex> lock(std::mutex);
         if (Cell::isZero(x))
             return this->has_zero ? iteratorToZero() : end();
 
         size_t hash_value = hash(x);
-        size_t place_value; bool empty;
-        std::tie(place_value, empty) = findCell<false>(x, grower.place(hash_value), buf);
-        return !buf[place_value].isZero() ? iterator(this, &buf[place_value]) : end();
+        EpochGuard guard(epochs);
+        if constexpr (incremental) {
+            enterTable();
+            Cell * old = old_buf.load();
+            helpMigrate();
+            Cell * cell = findInMigration(x, hash_value, old);
+            auto [cell_buf, cell_grower] = bufferOf(cell, old);
+            iterator res = cell && !cell->isDeleted() ? iteratorIn(cell, cell_buf, cell_grower) : end();
+            exitTable();
+            return res;
+        }
+
+        auto [cur_buf, cur_grower] = loadBuffer();
+        auto [place_value, empty] = findCell<false>(x, cur_grower.place(hash_value), cur_buf, cur_grower);
+        return !empty && !cur_buf[place_value].isDeleted() ? iteratorIn(&cur_buf[place_value], cur_buf, cur_grower) : end();
     }
 
     const_iterator find(const Key & x) const
     {
-        std::lock_guard<std::mutex> lock(std::mutex);
         if (Cell::isZero(x))
             return this->has_zero ? iteratorToZero() : end();
 
         size_t hash_value = hash(x);
-        size_t place_value; bool empty;
-        std::tie(place_value, empty) = findCell<false>(x, grower.place(hash_value), buf);
-        return empty ? const_iterator(this, &buf[place_value]) : end();
+        EpochGuard guard(epochs);
+        if constexpr (incremental) {
+            /// Lookups help the migration, which is not a logical change of the table.
+            Self * self = const_cast<Self *>(this);
+            self->enterTable();
+            Cell * old = self->old_buf.load();
+            self->helpMigrate();
+            Cell * cell = self->findInMigration(x, hash_value, old);
+            auto [cell_buf, cell_grower] = bufferOf(cell, old);
+            const_iterator res = cell && !cell->isDeleted() ? iteratorIn(cell, cell_buf, cell_grower) : end();
+            self->exitTable();
+            return res;
+        }
+
+        auto [cur_buf, cur_grower] = loadBuffer();
+        auto [place_value, empty] = findCell<false>(x, cur_grower.place(hash_value), cur_buf, cur_grower);
+        return !empty && !cur_buf[place_value].isDeleted() ? iteratorIn(&cur_buf[place_value], cur_buf, cur_grower) : end();
     }
 
-   const_iterator begin() const
+    const_iterator begin() const
     {
         if (!buf)
             return end();
@@ -420,11 +1212,12 @@ public:
         if (this->has_zero)
             return iteratorToZero();
 
-        const Cell * ptr = buf;
-        while (ptr < buf + grower.bufSize() && ptr->isInsertable())
+        auto [cur_buf, cur_grower] = iterationBuffer();
+        const Cell * ptr = cur_buf;
+        while (ptr < cur_buf + cur_grower.bufSize() && ptr->isInsertable())
             ++ptr;
 
-        return const_iterator(this, ptr);
+        return ptr == cur_buf + cur_grower.bufSize() ? end() : iteratorIn(ptr, cur_buf, cur_grower);
     }
 
     iterator begin()
@@ -435,16 +1228,16 @@ public:
         if (this->has_zero)
             return iteratorToZero();
 
-        Cell * ptr = buf;
-        while (ptr < buf + grower.bufSize() && ptr->isInsertable()) {
+        auto [cur_buf, cur_grower] = iterationBuffer();
+        Cell * ptr = cur_buf;
+        while (ptr < cur_buf + cur_grower.bufSize() && ptr->isInsertable())
             ++ptr;
-        }
 
-        return iterator(this, ptr);
+        return ptr == cur_buf + cur_grower.bufSize() ? end() : iteratorIn(ptr, cur_buf, cur_grower);
     }
 
-    const_iterator end() const         { return const_iterator(this, buf + grower.bufSize()); }
-    iterator end()                     { return iterator(this, buf + grower.bufSize()); }
+    const_iterator end() const         { return const_iterator(nullptr, nullptr, nullptr); }
+    iterator end()                     { return iterator(nullptr, nullptr, nullptr); }
 
 };
 
@@ -8,7 +8,7 @@
 namespace toy {
 
 // This map is a common interface, which supports different underlying algos.
-template <typename Key, typename Value, typename Compare = std::less<Key>, typename Allocator = StepAllocator<true>, class TreeType = BinarySearchTree<Key, Compare, std::pair<Key, Value>> >
+template <typename Key, typename Value, typename Compare = std::less<Key>, typename Allocator = StepAllocator<true>, class TreeType = BinarySearchTree<Key, Compare, std::pair<Key, Value>, Select1ST<Key, std::pair<Key, Value>>, Allocator> >
 class map
 {
 public:
@@ -6,6 +6,10 @@
 #include <unordered_map>
 
 #include <thread>
+#include <algorithm>
+#include <random>
+#include <cstdio>
+#include <unistd.h>
 
 template<class Map>
 void test1(Map & m, const std::string name) {
@@ -50,23 +54,303 @@ void single_insert(int mid, Map & m) {
 
 
 template<class Map>
-void bench(const std::string & name) {
+void bench(const std::string & name, int thread_num = 20) {
     Map m;
 
     auto begin_time = getTime();
 
     std::vector<std::thread> threads;
-    for (int i = 0; i < 20 ; i++) {
+    for (int i = 0; i < thread_num ; i++) {
         threads.push_back(std::thread(single_insert<Map>, i * 1000 + 500 , std::ref(m)));
     }
 
-    for (int i = 0; i < 20; i++) {
+    for (int i = 0; i < thread_num; i++) {
         threads[i].join();
     }
 
     auto end_time = getTime();
 
-    std::cout<< "structure " << name << " cost time : "<< end_time - begin_time << std::endl;
+    std::cout<< "structure " << name << " threads " << thread_num << " cost time : "<< end_time - begin_time << std::endl;
+}
+
+template<class Map>
+void stall_insert(int thread_id, int thread_num, int insert_num, Map & m, uint64_t & max_latency) {
+    max_latency = 0;
+    for (int i = 0; i < insert_num; i++)
+    {
+        /// Interleave the keys of the threads, `std::hash<int>` would put equal ranges into the same cells.
+        int key = i * thread_num + thread_id + 1;
+        auto begin_time = getTime();
+        m.insert(std::make_pair(key, key));
+        max_latency = std::max(max_latency, getTime() - begin_time);
+    }
+}
+
+/// The slowest single insert is the stall caused by a resize.
+template<class Map>
+void bench_stall(const std::string & name, int thread_num = 4, int insert_num = 1 << 20) {
+    Map m;
+
+    auto begin_time = getTime();
+
+    std::vector<std::thread> threads;
+    std::vector<uint64_t> max_latency(thread_num);
+    for (int i = 0; i < thread_num ; i++) {
+        threads.push_back(std::thread(stall_insert<Map>, i, thread_num, insert_num, std::ref(m), std::ref(max_latency[i])));
+    }
+
+    for (int i = 0; i < thread_num; i++) {
+        threads[i].join();
+    }
+
+    auto end_time = getTime();
+
+    std::cout<< "structure " << name << " threads " << thread_num << " cost time : "<< end_time - begin_time
+             << " max insert latency : " << *std::max_element(max_latency.begin(), max_latency.end()) << std::endl;
+}
+
+template<class Map>
+void read_heavy(int thread_id, int thread_num, int prefill, int op_num, int insert_percent, Map & m) {
+    std::mt19937 rng(thread_id);
+    int inserted = 0;
+    volatile int found = 0;
+    for (int i = 0; i < op_num; i++)
+    {
+        if (int(rng() % 100) < insert_percent) {
+            /// The new keys are above the prefilled ones and interleaved between the threads.
+            int key = prefill + inserted * thread_num + thread_id + 1;
+            ++inserted;
+            m.insert(std::make_pair(key, key));
+        } else {
+            found += m.find(rng() % prefill + 1) != m.end();
+        }
+    }
+}
+
+/// Mostly lookups of the prefilled keys with a few inserts. With a small prefill the inserts resize the table under the readers.
+template<class Map>
+void bench_read_heavy(const std::string & name, int thread_num = 20, int prefill = 1 << 18, int op_num = 100000, int insert_percent = 5) {
+    Map m;
+    for (int i = 1; i <= prefill; i++)
+        m.insert(std::make_pair(i, i));
+
+    auto begin_time = getTime();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_num ; i++) {
+        threads.push_back(std::thread(read_heavy<Map>, i, thread_num, prefill, op_num, insert_percent, std::ref(m)));
+    }
+
+    for (int i = 0; i < thread_num; i++) {
+        threads[i].join();
+    }
+
+    auto end_time = getTime();
+
+    std::cout<< "structure " << name << " threads " << thread_num << " " << 100 - insert_percent << "% find cost time : "<< end_time - begin_time << std::endl;
+}
+
+template<class Map>
+void mixed(int thread_id, int key_range, int op_num, int insert_percent, int erase_percent, Map & m) {
+    std::mt19937 rng(thread_id);
+    volatile int found = 0;
+    for (int i = 0; i < op_num; i++)
+    {
+        int key = rng() % key_range + 1;
+        int op = rng() % 100;
+        if (op < insert_percent)
+            m.insert(std::make_pair(key, key));
+        else if (op < insert_percent + erase_percent)
+            m.erase(key);
+        else
+            found += m.find(key) != m.end();
+    }
+}
+
+/// All the threads insert, erase and look up the same range of keys, so the erased cells are constantly taken back by the inserts.
+template<class Map>
+void bench_mixed(const std::string & name, int thread_num = 20, int key_range = 1 << 16, int op_num = 100000, int insert_percent = 25, int erase_percent = 25) {
+    Map m;
+    for (int i = 1; i <= key_range; i += 2)
+        m.insert(std::make_pair(i, i));
+
+    auto begin_time = getTime();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_num ; i++) {
+        threads.push_back(std::thread(mixed<Map>, i, key_range, op_num, insert_percent, erase_percent, std::ref(m)));
+    }
+
+    for (int i = 0; i < thread_num; i++) {
+        threads[i].join();
+    }
+
+    auto end_time = getTime();
+
+    std::cout<< "structure " << name << " threads " << thread_num << " " << insert_percent << "% insert " << erase_percent << "% erase cost time : "<< end_time - begin_time << std::endl;
+}
+
+/** Each thread owns the keys of its residue modulo `thread_num` and checks them itself, while the others grow and shrink the table.
+  * A round inserts the keys, erasing every odd one a bit later, then erases the even ones too, so the next round takes the deleted cells back.
+  * Every insert and erase must succeed and every find see exactly the state the owner left. After the last round, which keeps the even keys,
+  *  every key must be in the table once.
+  */
+template<class Table>
+void test_concurrent_erase(const std::string & name, int thread_num = 8, int keys_per_thread = 1 << 14, int rounds = 4) {
+    Table t;
+    std::atomic<size_t> failures{0};
+    const int lag = 64;
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_num; i++) {
+        threads.push_back(std::thread([&, i] {
+            auto key_of = [&](int j) { return i + 1 + thread_num * j; };
+            size_t failed = 0;
+            for (int round = 0; round < rounds; round++) {
+                for (int j = 0; j < keys_per_thread; j++) {
+                    failed += !t.insert_unique(std::make_pair(key_of(j), key_of(j) + round)).second;
+                    if (j >= lag && (j - lag) % 2)
+                        failed += !t.erase(key_of(j - lag));
+                }
+                for (int j = std::max(0, keys_per_thread - lag); j < keys_per_thread; j++)
+                    if (j % 2)
+                        failed += !t.erase(key_of(j));
+
+                for (int j = 0; j < keys_per_thread; j++) {
+                    auto guard = t.readGuard();
+                    auto it = t.find(key_of(j));
+                    if (j % 2)
+                        failed += it != t.end();
+                    else
+                        failed += it == t.end() || it->second != key_of(j) + round;
+                }
+
+                if (round + 1 < rounds)
+                    for (int j = 0; j < keys_per_thread; j += 2)
+                        failed += !t.erase(key_of(j));
+            }
+            failures += failed;
+        }));
+    }
+    for (auto & thread : threads)
+        thread.join();
+
+    std::vector<int> seen(size_t(thread_num) * keys_per_thread + thread_num + 1);
+    for (auto it = t.begin(); it != t.end(); ++it) {
+        int key = it->first;
+        if (key <= 0 || size_t(key) >= seen.size() || ++seen[key] > 1 || (key - 1) / thread_num % 2)
+            ++failures;
+    }
+    for (int key = 1; key <= thread_num * keys_per_thread; key++)
+        failures += (key - 1) / thread_num % 2 == 0 && seen[key] != 1;
+
+    std::cout << name << (failures ? " FAIL" : " pass") << " concurrent erase test, " << failures << " failures" << std::endl;
+}
+
+/// Resident memory of the process in bytes.
+size_t getRSS()
+{
+    size_t pages = 0, resident = 0;
+    FILE * file = fopen("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf(file, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose(file);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/** The resident memory a table of `Cell` takes for `elems` elements, and the size of its buffer per element.
+  * The keys are the counter times an odd constant modulo 2^30, which keeps them distinct, non-zero and clear of the state bits
+  *  of the compact cell, and spreads them over the range, so that `std::hash`, the identity, scatters them over the buffer
+  *  as a real hash would. With sequential keys only the first cells of the buffer would be touched, and the untouched pages would not count.
+  */
+template<class Cell>
+void bench_memory(const std::string & name, int elems = 1 << 22, int thread_num = 4) {
+    size_t begin_rss = getRSS();
+    auto begin_time = getTime();
+    {
+        toy::HashTable<int, Cell> t;
+        std::vector<std::thread> threads;
+        for (int i = 0; i < thread_num; i++) {
+            threads.push_back(std::thread([&t, i, elems, thread_num] {
+                for (uint32_t n = i + 1; n <= uint32_t(elems); n += thread_num) {
+                    int key = int(n * 2654435761u & 0x3fffffff);
+                    t.insert_unique(std::make_pair(key, key));
+                }
+            }));
+        }
+        for (int i = 0; i < thread_num; i++) {
+            threads[i].join();
+        }
+
+        size_t bytes = getRSS() - begin_rss;
+        size_t buf_bytes = t.grower.bufSize() * sizeof(Cell);
+        std::cout<< "structure " << name << " elems " << elems << " rss " << (bytes >> 20) << " MiB, " << double(bytes) / elems
+                 << " bytes per element, buffer " << double(buf_bytes) / elems << " bytes per element, insert cost time : " << getTime() - begin_time << std::endl;
+    }
+}
+
+/** Insert the same keys on one thread into a table which rehashes on one thread and into one which rehashes on `threads` threads,
+  *  until they grow to 2^degree cells, and report the slowest insert of each, the one of the last resize.
+  * The cells must be the same in both buffers.
+  */
+template<size_t threads>
+void bench_parallel_resize(int degree = 26) {
+    using Cell = toy::CompactHashMapCell<int, int, std::hash<int>>;
+    toy::HashTable<int, Cell, toy::ParallelHashTableGrower<1>> serial;
+    toy::HashTable<int, Cell, toy::ParallelHashTableGrower<threads>> t;
+
+    std::mt19937 rng(42);
+    uint64_t serial_max = 0, parallel_max = 0;
+    while (t.grower.size_degree < degree) {
+        int key = (rng() & 0x3fffffff) | 1;
+        auto begin_time = getTime();
+        serial.insert_unique(std::make_pair(key, key));
+        auto serial_time = getTime();
+        t.insert_unique(std::make_pair(key, key));
+        auto parallel_time = getTime();
+        serial_max = std::max<uint64_t>(serial_max, serial_time - begin_time);
+        parallel_max = std::max<uint64_t>(parallel_max, parallel_time - serial_time);
+    }
+
+    bool same = serial.grower.bufSize() == t.grower.bufSize();
+    for (size_t i = 0; same && i < t.grower.bufSize(); i++)
+        same = serial.buf[i].isZero() ? t.buf[i].isZero() : t.buf[i].getValue() == serial.buf[i].getValue();
+
+    std::cout << "structure toy::compact_hash_map resize to 2^" << degree << " cells threads " << threads << " serial : " << serial_max / 1000000
+              << " ms parallel : " << parallel_max / 1000000 << " ms same cells : " << same << std::endl;
+}
+
+/** Iterate under `readGuard` while another thread inserts and resizes the table. Each pass must see every prefilled key once,
+  *  also when the buffer it walks has been switched meanwhile.
+  */
+template<class Table>
+void test_iterate_while_insert(const std::string & name, int prefill = 1 << 12, int inserts = 1 << 18) {
+    Table t;
+    for (int key = 1; key <= prefill; key++)
+        t.insert_unique(std::make_pair(key, key));
+
+    std::atomic<bool> done{false};
+    std::thread inserter([&] {
+        for (int key = prefill + 1; key <= prefill + inserts; key++)
+            t.insert_unique(std::make_pair(key, key));
+        done = true;
+    });
+
+    size_t passes = 0;
+    bool ok = true;
+    while (!done || passes == 0) {
+        auto guard = t.readGuard();
+        int seen = 0;
+        for (auto it = t.begin(); it != t.end(); ++it)
+            seen += it->first <= prefill;
+        ok &= seen == prefill;
+        ++passes;
+    }
+    inserter.join();
+
+    std::cout << name << (ok ? " pass" : " FAIL") << " iterate while insert, " << passes << " passes" << std::endl;
 }
 
 template <typename Map>
@@ -81,6 +365,20 @@ struct LockMap {
         std::lock_guard<std::mutex> lock(mutex_);
         return m.insert(v);
     }
+
+    size_t erase(const typename Map::key_type & k) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return m.erase(k);
+    }
+
+    iterator find(const typename Map::key_type & k) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return m.find(k);
+    }
+
+    iterator end() {
+        return m.end();
+    }
 };
 
 int main() {
@@ -98,5 +396,79 @@ int main() {
 
     bench<hash_map>(std::string("toy::hash_map"));
 
+    using lock_free_hash_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::HashTable<int, toy::LockFreeHashMapCell<int, int, std::hash<int>> > >;
+    lock_free_hash_map m2;
+
+    test1(m2, "lock free hash table");
+
+    for (int thread_num : {1, 2, 4, 8, 16, 20})
+        bench<lock_free_hash_map>(std::string("toy::lock_free_hash_map"), thread_num);
+
+    using incremental_hash_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::HashTable<int, toy::LockFreeHashMapCell<int, int, std::hash<int>>, toy::IncrementalHashTableGrower<> > >;
+    incremental_hash_map m3;
+
+    test1(m3, "incremental hash table");
+
+    bench<incremental_hash_map>(std::string("toy::incremental_hash_map"));
+
+    bench_stall<lock_free_hash_map>(std::string("toy::lock_free_hash_map"));
+    bench_stall<incremental_hash_map>(std::string("toy::incremental_hash_map"));
+
+    using seqlock_hash_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::HashTable<int, toy::SeqLockHashMapCell<int, int, std::hash<int>> > >;
+    seqlock_hash_map m4;
+
+    test1(m4, "seqlock hash table");
+
+    bench<seqlock_hash_map>(std::string("toy::seqlock_hash_map"));
+
+    bench_read_heavy<LockMap<std::map<int,int>>>(std::string("std::map"));
+    bench_read_heavy<hash_map>(std::string("toy::hash_map"));
+    bench_read_heavy<seqlock_hash_map>(std::string("toy::seqlock_hash_map"));
+    bench_read_heavy<lock_free_hash_map>(std::string("toy::lock_free_hash_map"));
+
+    /// The readers keep probing the retired buffers while the table grows from 2^12 to 2^18 cells.
+    bench_read_heavy<seqlock_hash_map>(std::string("toy::seqlock_hash_map with resizes"), 20, 1 << 10);
+    bench_read_heavy<lock_free_hash_map>(std::string("toy::lock_free_hash_map with resizes"), 20, 1 << 10);
+
+    using compact_hash_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::HashTable<int, toy::CompactHashMapCell<int, int, std::hash<int>> > >;
+    compact_hash_map m5;
+
+    test1(m5, "compact hash table");
+
+    bench<compact_hash_map>(std::string("toy::compact_hash_map"));
+
+    test_concurrent_erase<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>>>(std::string("hash table"));
+    test_concurrent_erase<toy::HashTable<int, toy::SeqLockHashMapCell<int, int, std::hash<int>>>>(std::string("seqlock hash table"));
+    test_concurrent_erase<toy::HashTable<int, toy::LockFreeHashMapCell<int, int, std::hash<int>>>>(std::string("lock free hash table"));
+    test_concurrent_erase<toy::HashTable<int, toy::LockFreeHashMapCell<int, int, std::hash<int>>, toy::IncrementalHashTableGrower<>>>(std::string("incremental hash table"));
+    test_concurrent_erase<toy::HashTable<int, toy::CompactHashMapCell<int, int, std::hash<int>>>>(std::string("compact hash table"));
+
+    test_iterate_while_insert<toy::HashTable<int, toy::SeqLockHashMapCell<int, int, std::hash<int>>>>(std::string("seqlock hash table"));
+    test_iterate_while_insert<toy::HashTable<int, toy::LockFreeHashMapCell<int, int, std::hash<int>>>>(std::string("lock free hash table"));
+    test_iterate_while_insert<toy::HashTable<int, toy::LockFreeHashMapCell<int, int, std::hash<int>>, toy::IncrementalHashTableGrower<>>>(std::string("incremental hash table"));
+    test_iterate_while_insert<toy::HashTable<int, toy::CompactHashMapCell<int, int, std::hash<int>>>>(std::string("compact hash table"));
+
+    for (auto [insert_percent, erase_percent] : {std::make_pair(25, 25), std::make_pair(10, 10)}) {
+        bench_mixed<LockMap<std::map<int,int>>>(std::string("std::map"), 20, 1 << 16, 100000, insert_percent, erase_percent);
+        bench_mixed<hash_map>(std::string("toy::hash_map"), 20, 1 << 16, 100000, insert_percent, erase_percent);
+        bench_mixed<seqlock_hash_map>(std::string("toy::seqlock_hash_map"), 20, 1 << 16, 100000, insert_percent, erase_percent);
+        bench_mixed<lock_free_hash_map>(std::string("toy::lock_free_hash_map"), 20, 1 << 16, 100000, insert_percent, erase_percent);
+        bench_mixed<incremental_hash_map>(std::string("toy::incremental_hash_map"), 20, 1 << 16, 100000, insert_percent, erase_percent);
+        bench_mixed<compact_hash_map>(std::string("toy::compact_hash_map"), 20, 1 << 16, 100000, insert_percent, erase_percent);
+    }
+
+    /// The two tables take 1GB.
+    bench_parallel_resize<2>();
+    bench_parallel_resize<4>();
+    bench_parallel_resize<8>();
+    bench_parallel_resize<16>();
+
+    /// 72 bytes of a `HashMapCell<int, int>` against 8 of a `CompactHashMapCell<int, int>`. The buffer of 2^22 elements
+    ///  is at a quarter load, 100M elements fill 2^28 cells to 37%.
+    bench_memory<toy::HashMapCell<int, int, std::hash<int>>>(std::string("toy::hash_map"));
+    bench_memory<toy::SeqLockHashMapCell<int, int, std::hash<int>>>(std::string("toy::seqlock_hash_map"));
+    bench_memory<toy::LockFreeHashMapCell<int, int, std::hash<int>>>(std::string("toy::lock_free_hash_map"));
+    bench_memory<toy::CompactHashMapCell<int, int, std::hash<int>>>(std::string("toy::compact_hash_map"));
+    bench_memory<toy::CompactHashMapCell<int, int, std::hash<int>>>(std::string("toy::compact_hash_map"), 100000000);
 
 }
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "hash_table.h"
+#include "hash.h"
+
+#include <memory>
+#include <vector>
+
+namespace toy {
+
+/** GROUP BY on several threads. Each thread aggregates its rows into a table of its own with no synchronization,
+  *  then `merge` combines the thread tables on several threads with `HashTable::merge`, which scatters their cells by the place
+  *  in the result and merges each range of the result buffer on a thread of its own.
+  * `Merge` is called as `merge(mapped, value)` both for a row and for the partial result of another thread, like `+=` for COUNT and SUM.
+  */
+template <typename Key, typename Mapped, typename Merge, typename Cell = HashMapCell<Key, Mapped, MurmurHash<Key>>, typename Table_ = HashTable<Key, Cell>>
+class Aggregator
+{
+public:
+    using Table = Table_;
+
+    Aggregator(size_t num_threads, Merge merge_ = Merge()) : merge_fn(merge_)
+    {
+        for (size_t i = 0; i < num_threads; ++i)
+            thread_tables.emplace_back(new Table);
+    }
+
+    /// Aggregate a block of rows on the thread `thread`. Different threads may call it at the same time.
+    /// The aggregator is single-use: no rows may be added after merge().
+    void add(size_t thread, const Key * keys, const Mapped * values, size_t count)
+    {
+        if (thread >= thread_tables.size())
+            throw "add after merge or bad thread number";
+        thread_tables[thread]->emplace_or_update_batch(keys, values, count, merge_fn);
+    }
+
+    /// Merge the thread tables into the result on `num_threads` threads. The thread tables are freed.
+    void merge(size_t num_threads)
+    {
+        if (num_threads == 0)
+            throw "merge needs at least one thread";
+        if (thread_tables.empty())
+            throw "the aggregator is already merged";
+
+        std::vector<const Table *> sources;
+        for (const auto & table : thread_tables)
+            sources.push_back(table.get());
+
+        result.reset(new Table);
+        result->merge(sources, num_threads, merge_fn);
+
+        thread_tables.clear();
+    }
+
+    /// The result of `merge`.
+    const Table & getResult() const { return *result; }
+
+    /// Call `func(value)` for each aggregated key after `merge`.
+    template <typename Func>
+    void forEach(Func && func) const
+    {
+        for (const auto & value : *result)
+            func(value);
+    }
+
+private:
+    Merge merge_fn;
+
+    std::vector<std::unique_ptr<Table>> thread_tables;
+    std::unique_ptr<Table> result;
+};
+
+}
@@ -1,16 +1,69 @@
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 #include "alloc.h"
 #include <cstring>
 #include <cstdlib>
 
 namespace toy {
 
-static constexpr size_t MMAP_THRESHOLD = 64 * (1ULL << 20);
+static constexpr size_t HUGE_PAGE_SIZE = 2 * (1ULL << 20);
 
-template<bool clear_mem>
-void * StepAllocator<clear_mem>::alloc(size_t n) {
+/// The pages of MAP_HUGETLB are mapped and unmapped whole, so the mappings of the huge page modes are rounded up to them.
+static size_t mappedSize(size_t n, HugePages huge_pages)
+{
+    return huge_pages == HugePages::none ? n : (n + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+/// The placement is a hint, like the transparent huge pages: without NUMA support in the kernel the memory works just the same.
+static void bindPages(void * buf, size_t n, NumaPolicy numa_policy)
+{
+    if (numa_policy == NumaPolicy::none)
+        return;
+
+    unsigned long nodemask[16] = {};
+    const unsigned long maxnode = sizeof(nodemask) * 8;
+    int mode;
+    if (numa_policy == NumaPolicy::interleave) {
+        if (0 != syscall(SYS_get_mempolicy, nullptr, nodemask, maxnode, nullptr, MPOL_F_MEMS_ALLOWED))
+            return;
+        mode = MPOL_INTERLEAVE;
+    } else {
+        unsigned cpu, node;
+        if (0 != syscall(SYS_getcpu, &cpu, &node, nullptr) || node >= maxnode)
+            return;
+        nodemask[node / 64] |= 1UL << (node % 64);
+        mode = MPOL_PREFERRED;
+    }
+    syscall(SYS_mbind, buf, n, mode, nodemask, maxnode, 0);
+}
+
+static void * mapPages(size_t n, HugePages huge_pages, NumaPolicy numa_policy)
+{
+    n = mappedSize(n, huge_pages);
+
+    void * buf = MAP_FAILED;
+    if (huge_pages == HugePages::hugetlb)
+        buf = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (MAP_FAILED == buf) {
+        buf = mmap(nullptr, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == buf)
+            throw "bad alloc";
+        /// Fails only if the kernel has no transparent huge pages at all.
+        if (huge_pages != HugePages::none)
+            madvise(buf, n, MADV_HUGEPAGE);
+    }
+
+    /// Before the first touch, which is when the pages are placed.
+    bindPages(buf, n, numa_policy);
+    return buf;
+}
+
+template<bool clear_mem, HugePages huge_pages, NumaPolicy numa_policy>
+void * StepAllocator<clear_mem, huge_pages, numa_policy>::alloc(size_t n) {
     void * buf;
-    if (n < MMAP_THRESHOLD) {
+    if (n < mmap_threshold) {
         if (clear_mem)
             buf = ::calloc(n,1);
         else
@@ -18,40 +71,46 @@ void * StepAllocator<clear_mem>::alloc(size_t n) {
         if (buf == nullptr)
             throw "bad alloc";
     } else {
-        buf = mmap(nullptr, n,  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (MAP_FAILED == buf)
-            throw "bad alloc";
+        buf = mapPages(n, huge_pages, numa_policy);
     }
     return buf;
 }
 
-template<bool clear_mem>
-void * StepAllocator<clear_mem>::free(void * buf, size_t n)
+template<bool clear_mem, HugePages huge_pages, NumaPolicy numa_policy>
+void * StepAllocator<clear_mem, huge_pages, numa_policy>::free(void * buf, size_t n)
 {
-    if (n < MMAP_THRESHOLD) {
+    if (n < mmap_threshold) {
         ::free(buf);
     } else {
-        if (0 != munmap(buf, n))
+        if (0 != munmap(buf, mappedSize(n, huge_pages)))
             throw "bad alloc";
     }
+    return nullptr;
 }
 
-template<bool clear_mem>
-void * StepAllocator<clear_mem>::realloc(void * buf, size_t old_size, size_t new_size) {
-    if (old_size > MMAP_THRESHOLD && new_size > MMAP_THRESHOLD) {
-        buf = mremap(buf, old_size, new_size, MREMAP_MAYMOVE,  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+template<bool clear_mem, HugePages huge_pages, NumaPolicy numa_policy>
+void * StepAllocator<clear_mem, huge_pages, numa_policy>::realloc(void * buf, size_t old_size, size_t new_size) {
+    /// mremap keeps madvise and mbind of the mapping, but can't grow a mapping of MAP_HUGETLB, so that one is copied.
+    if (old_size >= mmap_threshold && new_size >= mmap_threshold && huge_pages != HugePages::hugetlb) {
+        buf = mremap(buf, mappedSize(old_size, huge_pages), mappedSize(new_size, huge_pages), MREMAP_MAYMOVE);
         if (MAP_FAILED == buf)
             throw "bad alloc";
     }
-    else if (old_size < MMAP_THRESHOLD && new_size >= MMAP_THRESHOLD) {
+    else if (old_size >= mmap_threshold && new_size >= mmap_threshold) {
+        void * new_buf = alloc(new_size);
+        memcpy(new_buf, buf, old_size < new_size ? old_size : new_size);
+        free(buf, old_size);
+        buf = new_buf;
+    }
+    else if (old_size < mmap_threshold && new_size >= mmap_threshold) {
         void * new_buf = alloc(new_size);
         memcpy(new_buf, buf, old_size);
         free(buf, old_size);
         buf = new_buf;
-    } else if (old_size >= MMAP_THRESHOLD && new_size < MMAP_THRESHOLD) {
+    } else if (old_size >= mmap_threshold && new_size < mmap_threshold) {
         void * new_buf = alloc(new_size);
         memcpy(new_buf, buf, new_size);
-        if( 0 != munmap(buf, old_size)) {
+        if( 0 != munmap(buf, mappedSize(old_size, huge_pages))) {
             free(new_buf, new_size);
             throw "cannot unmap";
         }
@@ -69,13 +128,151 @@ void * StepAllocator<clear_mem>::realloc(void * buf, size_t old_size, size_t new
 
 template  class StepAllocator<true>;
 template  class StepAllocator<false>;
+template  class StepAllocator<true, HugePages::transparent>;
+template  class StepAllocator<false, HugePages::transparent>;
+template  class StepAllocator<true, HugePages::hugetlb>;
+template  class StepAllocator<false, HugePages::hugetlb>;
+template  class StepAllocator<true, HugePages::none, NumaPolicy::interleave>;
+template  class StepAllocator<true, HugePages::none, NumaPolicy::local>;
+template  class StepAllocator<true, HugePages::transparent, NumaPolicy::interleave>;
+template  class StepAllocator<true, HugePages::transparent, NumaPolicy::local>;
+template  class StepAllocator<true, HugePages::hugetlb, NumaPolicy::interleave>;
+template  class StepAllocator<true, HugePages::hugetlb, NumaPolicy::local>;
+
+static constexpr size_t CHUNK_SIZE = 64 * 1024;
+static constexpr size_t CHUNK_HEADER_SIZE = 16;
+static constexpr size_t MAX_CACHED_CHUNKS = 64;
+
+/// The chunks released by the node allocators of this thread.
+struct ChunkCache {
+    void * head = nullptr;
+    size_t count = 0;
+
+    void * pop() {
+        if (head == nullptr)
+            return nullptr;
+        void * chunk = head;
+        head = *reinterpret_cast<void **>(chunk);
+        count--;
+        return chunk;
+    }
+
+    bool push(void * chunk) {
+        if (count >= MAX_CACHED_CHUNKS)
+            return false;
+        *reinterpret_cast<void **>(chunk) = head;
+        head = chunk;
+        count++;
+        return true;
+    }
 
+    ~ChunkCache() {
+        while (void * chunk = pop())
+            ::free(chunk);
+    }
+};
+
+static thread_local ChunkCache chunk_cache;
+
+/// The header of a big piece, a multiple of 16 bytes like the size classes, so the piece keeps the alignment of malloc.
+template<bool clear_mem>
+struct alignas(16) NodeAllocator<clear_mem>::LargeBlock {
+    LargeBlock * prev;
+    LargeBlock * next;
+    /// With the header.
+    size_t size;
+};
+
+template<bool clear_mem>
+NodeAllocator<clear_mem>::NodeAllocator() : chunks(nullptr), chunk_pos(nullptr), chunk_end(nullptr), large_blocks(nullptr) {
+    for (size_t i = 0; i < size_classes; i++)
+        free_list[i] = nullptr;
+}
+
+template<bool clear_mem>
+NodeAllocator<clear_mem>::~NodeAllocator() {
+    while (chunks != nullptr) {
+        void * chunk = chunks;
+        chunks = *reinterpret_cast<void **>(chunk);
+        if (!chunk_cache.push(chunk))
+            ::free(chunk);
+    }
+
+    while (large_blocks != nullptr) {
+        LargeBlock * block = large_blocks;
+        large_blocks = block->next;
+        StepAllocator<clear_mem>().free(block, block->size);
+    }
+}
+
+template<bool clear_mem>
+void * NodeAllocator<clear_mem>::alloc(size_t n) {
+    if (n > max_class_size) {
+        LargeBlock * block = reinterpret_cast<LargeBlock *>(StepAllocator<clear_mem>().alloc(n + sizeof(LargeBlock)));
+        block->size = n + sizeof(LargeBlock);
+        block->prev = nullptr;
+        block->next = large_blocks;
+        if (large_blocks)
+            large_blocks->prev = block;
+        large_blocks = block;
+        return block + 1;
+    }
+
+    size_t size_class = n == 0 ? 0 : (n - 1) / size_class_step;
+    void * buf = free_list[size_class];
+    if (buf != nullptr) {
+        free_list[size_class] = *reinterpret_cast<void **>(buf);
+    } else {
+        size_t size = (size_class + 1) * size_class_step;
+        if (chunk_pos + size > chunk_end) {
+            void * chunk = chunk_cache.pop();
+            if (chunk == nullptr)
+                chunk = ::malloc(CHUNK_SIZE);
+            if (chunk == nullptr)
+                throw "bad alloc";
+            *reinterpret_cast<void **>(chunk) = chunks;
+            chunks = chunk;
+            chunk_pos = reinterpret_cast<char *>(chunk) + CHUNK_HEADER_SIZE;
+            chunk_end = reinterpret_cast<char *>(chunk) + CHUNK_SIZE;
+        }
+        buf = chunk_pos;
+        chunk_pos += size;
+    }
+
+    /// Both the free lists and the cached chunks hold garbage.
+    if (clear_mem)
+        memset(buf, 0, n);
+    return buf;
+}
+
+template<bool clear_mem>
+void * NodeAllocator<clear_mem>::free(void * buf, size_t n) {
+    if (n > max_class_size) {
+        LargeBlock * block = reinterpret_cast<LargeBlock *>(buf) - 1;
+        if (block->prev)
+            block->prev->next = block->next;
+        else
+            large_blocks = block->next;
+        if (block->next)
+            block->next->prev = block->prev;
+        return StepAllocator<clear_mem>().free(block, block->size);
+    }
+
+    size_t size_class = n == 0 ? 0 : (n - 1) / size_class_step;
+    *reinterpret_cast<void **>(buf) = free_list[size_class];
+    free_list[size_class] = buf;
+    return nullptr;
+}
+
+template<bool clear_mem>
+void * NodeAllocator<clear_mem>::realloc(void * buf, size_t old_size, size_t new_size) {
+    void * new_buf = alloc(new_size);
+    memcpy(new_buf, buf, old_size < new_size ? old_size : new_size);
+    free(buf, old_size);
+    return new_buf;
+}
 
-//NodeAllocator:: NodeAllocator() {
-//    for (int i = 0; i < 16; i++)
-//    {
-//
-//    }
-//}
+template  class NodeAllocator<true>;
+template  class NodeAllocator<false>;
 
 }
@@ -1,9 +1,35 @@
-#pragma once
+/// toy/concurrency keeps a copy of this file and is built together with the headers of toy/map, so guard by name, not by file.
+#ifndef TOY_ALLOC_H
+#define TOY_ALLOC_H
+
+#include <cstddef>
 
 namespace toy {
 
 
-template <bool clear_mem>
+/// How the buffers of `StepAllocator` which are big enough to be mapped are backed by pages.
+enum class HugePages
+{
+    /// The pages of 4KB.
+    none,
+    /// Ask for transparent huge pages with madvise(MADV_HUGEPAGE). The kernel gives them when it has free 2MB pages, and 4KB pages otherwise.
+    transparent,
+    /// Map from the pool of huge pages reserved in /proc/sys/vm/nr_hugepages with MAP_HUGETLB. When the pool is short, fall back to `transparent`.
+    hugetlb,
+};
+
+/// On which NUMA nodes the pages of the mapped buffers are placed.
+enum class NumaPolicy
+{
+    /// The policy of the process, by default the node of the thread which touches a page first.
+    none,
+    /// Round robin over all allowed nodes, for the tables which are used by the threads of all nodes.
+    interleave,
+    /// The node of the thread which allocates the buffer, whoever touches the pages first. A full node spills to the others.
+    local,
+};
+
+template <bool clear_mem, HugePages huge_pages = HugePages::none, NumaPolicy numa_policy = NumaPolicy::none>
 class StepAllocator {
 public:
 
@@ -13,11 +39,54 @@ public:
 
     void * realloc(void * p, size_t old_size, size_t new_size);
 
+    /// Whether the memory is released with the allocator, so the owner doesn't need to free piece by piece.
+    static constexpr bool free_in_bulk = false;
+
+    /// The buffers from this size on are mapped, the smaller ones come from malloc. Huge pages and the placement work with whole pages,
+    ///  so then everything from the size of a huge page on is mapped.
+    static constexpr size_t mmap_threshold = huge_pages == HugePages::none && numa_policy == NumaPolicy::none ? 64 * (1ULL << 20) : 2 * (1ULL << 20);
 };
 
-//class NodeAllocator {
-//    void * free_list[16];
-//    NodeAllocator() ;
-//}
+/** The allocator for tree nodes. Small sizes are rounded up to size classes of 16 bytes and carved from large chunks,
+  *  a freed piece goes to the free list of its class. Bigger sizes go to StepAllocator with a header linking them into a list.
+  * All chunks are released at once with the allocator, into a cache of the thread, so short lived trees rarely reach malloc.
+  *  The big pieces which are still there are freed then as well.
+  */
+template <bool clear_mem>
+class NodeAllocator {
+public:
+    NodeAllocator();
+    ~NodeAllocator();
+
+    NodeAllocator(const NodeAllocator &) = delete;
+    NodeAllocator & operator=(const NodeAllocator &) = delete;
+
+    void * alloc(size_t n);
+
+    void * free(void * p, size_t n);
+
+    void * realloc(void * p, size_t old_size, size_t new_size);
+
+    static constexpr bool free_in_bulk = true;
+
+private:
+    static constexpr size_t size_class_step = 16;
+    static constexpr size_t size_classes = 16;
+
+    void * free_list[size_classes];
+
+    /// The chunks are linked through their first bytes.
+    void * chunks;
+    char * chunk_pos;
+    char * chunk_end;
+
+    /// The pieces bigger than the largest class, in a doubly linked list so that `free` unlinks one at once.
+    struct LargeBlock;
+    LargeBlock * large_blocks;
+
+    static constexpr size_t max_class_size = size_class_step * size_classes;
+};
 
 }
+
+#endif
@@ -0,0 +1,219 @@
+#pragma once
+
+#include "alloc.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+namespace toy {
+
+/** A bump allocator: the pieces are carved one after another from big chunks, and only released all at once with the arena.
+  * There is no per piece header. `alloc` doesn't align, it is meant for bytes like the keys of the string hash table, `alignedAlloc` does.
+  * Each chunk is twice as big as the previous one, so the number of chunks is logarithmic in the total size.
+  */
+class Arena
+{
+    /// The header at the beginning of each chunk, the chunks are linked from the last one.
+    struct Chunk
+    {
+        Chunk * prev;
+        size_t size;
+    };
+
+    static constexpr size_t initial_chunk_size = 4096;
+    static constexpr size_t max_chunk_size = 128 * (1ULL << 20);
+
+    StepAllocator<false> allocator;
+
+    Chunk * last = nullptr;
+    char * pos = nullptr;
+    char * end = nullptr;
+
+    size_t allocated = 0;
+
+    void addChunk(size_t n)
+    {
+        size_t size = last ? std::min(last->size * 2, max_chunk_size) : initial_chunk_size;
+        size = std::max(size, n + sizeof(Chunk));
+
+        Chunk * chunk = reinterpret_cast<Chunk *>(allocator.alloc(size));
+        chunk->prev = last;
+        chunk->size = size;
+        last = chunk;
+        pos = reinterpret_cast<char *>(chunk + 1);
+        end = reinterpret_cast<char *>(chunk) + size;
+        allocated += size;
+    }
+
+    void freeChunks()
+    {
+        while (last)
+        {
+            Chunk * prev = last->prev;
+            allocator.free(last, last->size);
+            last = prev;
+        }
+    }
+
+public:
+    Arena() {}
+
+    ~Arena()
+    {
+        freeChunks();
+    }
+
+    Arena(const Arena &) = delete;
+    Arena & operator=(const Arena &) = delete;
+
+    char * alloc(size_t n)
+    {
+        if (size_t(end - pos) < n)
+            addChunk(n);
+        char * res = pos;
+        pos += n;
+        return res;
+    }
+
+    /// `alignment` is a power of two.
+    char * alignedAlloc(size_t n, size_t alignment)
+    {
+        char * res = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(pos) + alignment - 1) & ~(alignment - 1));
+        if (!pos || res > end || size_t(end - res) < n)
+        {
+            addChunk(n + alignment);
+            res = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(pos) + alignment - 1) & ~(alignment - 1));
+        }
+        pos = res + n;
+        return res;
+    }
+
+    /// Resize the last piece in place if the chunk has room, otherwise copy the piece to a new one. The old piece is not reused.
+    char * realloc(char * piece, size_t old_size, size_t new_size, size_t alignment)
+    {
+        if (piece + old_size == pos && size_t(end - piece) >= new_size)
+        {
+            pos = piece + new_size;
+            return piece;
+        }
+        char * res = alignedAlloc(new_size, alignment);
+        memcpy(res, piece, std::min(old_size, new_size));
+        return res;
+    }
+
+    /** Forget all pieces at once. The last chunk, usually the biggest one, is kept for the pieces to come,
+      *  so an arena reset after each request soon stops asking the allocator for memory.
+      */
+    void reset()
+    {
+        if (!last)
+            return;
+
+        Chunk * keep = last;
+        last = last->prev;
+        freeChunks();
+        keep->prev = nullptr;
+        last = keep;
+        pos = reinterpret_cast<char *>(keep + 1);
+        end = reinterpret_cast<char *>(keep) + keep->size;
+        allocated = keep->size;
+    }
+
+    /// Copy `n` bytes into the arena.
+    const char * insert(const char * data, size_t n)
+    {
+        char * res = alloc(n);
+        memcpy(res, data, n);
+        return res;
+    }
+
+    /// The memory taken from the allocator, with the unused tails of the chunks.
+    size_t allocatedBytes() const { return allocated; }
+};
+
+/** Makes `arena` the arena of the `ArenaAllocator`s constructed on this thread while the scope lives, so that all maps of a request share it:
+  *
+  *     Arena arena;
+  *     for (auto & request : requests)
+  *     {
+  *         {
+  *             ArenaScope scope(arena);
+  *             toy::map<int, int, std::less<int>, ArenaAllocator<true>> users, items;
+  *             ...
+  *         }
+  *         arena.reset();
+  *     }
+  *
+  * The maps must be gone before the arena is reset. The scopes nest.
+  */
+class ArenaScope
+{
+public:
+    explicit ArenaScope(Arena & arena) : prev(current)
+    {
+        current = &arena;
+    }
+
+    ~ArenaScope()
+    {
+        current = prev;
+    }
+
+    ArenaScope(const ArenaScope &) = delete;
+    ArenaScope & operator=(const ArenaScope &) = delete;
+
+    /// The arena of the innermost scope of this thread, or nullptr.
+    static Arena * get() { return current; }
+
+private:
+    Arena * prev;
+
+    static inline thread_local Arena * current = nullptr;
+};
+
+/** The allocator with the interface of `StepAllocator` on top of an arena. `free` does nothing, everything is released at once
+  *  with the arena, so a map gets neither a malloc per node nor a free per node, and its destructor doesn't walk the nodes.
+  * The allocator takes the arena of the current `ArenaScope` when constructed, or without a scope keeps an arena of its own,
+  *  which goes away with the map.
+  * A growing hash table leaves its old buffers in the arena, together they are smaller than the last one.
+  */
+template <bool clear_mem>
+class ArenaAllocator
+{
+public:
+    ArenaAllocator() : arena(ArenaScope::get() ? ArenaScope::get() : &own_arena) {}
+
+    ArenaAllocator(const ArenaAllocator &) = delete;
+    ArenaAllocator & operator=(const ArenaAllocator &) = delete;
+
+    void * alloc(size_t n)
+    {
+        char * res = arena->alignedAlloc(n, alignment);
+        /// The pieces of an arena which was reset hold garbage.
+        if (clear_mem)
+            memset(res, 0, n);
+        return res;
+    }
+
+    void * free(void * /*p*/, size_t /*n*/) { return nullptr; }
+
+    void * realloc(void * p, size_t old_size, size_t new_size)
+    {
+        char * res = arena->realloc(static_cast<char *>(p), old_size, new_size, alignment);
+        if (clear_mem && new_size > old_size)
+            memset(res + old_size, 0, new_size - old_size);
+        return res;
+    }
+
+    static constexpr bool free_in_bulk = true;
+
+private:
+    static constexpr size_t alignment = alignof(std::max_align_t);
+
+    Arena own_arena;
+    Arena * arena;
+};
+
+}
@@ -0,0 +1,392 @@
+#pragma once
+
+#include<utility>
+#include<type_traits>
+#include<algorithm>
+#include<cstring>
+#include<cstdint>
+
+#include "bst.h"
+
+namespace toy {
+
+/// Keep a node within `node_bytes`, but let it hold at least a few entries even for big values.
+constexpr size_t bplusTreeCapacity(size_t node_bytes, size_t header_bytes, size_t entry_bytes) {
+    return node_bytes > header_bytes + 4 * entry_bytes ? (node_bytes - header_bytes) / entry_bytes : 4;
+}
+
+/// The keys of a leaf are kept apart from the values, so that a search only reads the cache lines of the keys.
+template<typename Key, typename Value, size_t node_bytes>
+struct BPlusTreeLeaf {
+    static constexpr size_t capacity = bplusTreeCapacity(node_bytes, 2 * sizeof(void *) + sizeof(size_t), sizeof(Key) + sizeof(Value));
+
+    size_t count;
+    BPlusTreeLeaf * prev;
+    BPlusTreeLeaf * next;
+    Key keys[capacity];
+    Value values[capacity];
+};
+
+/// The child `i` holds the keys in [keys[i - 1], keys[i]).
+template<typename Key, size_t node_bytes>
+struct BPlusTreeInner {
+    static constexpr size_t capacity = bplusTreeCapacity(node_bytes, sizeof(size_t) + sizeof(void *), sizeof(Key) + sizeof(void *));
+
+    size_t count;
+    Key keys[capacity];
+    void * children[capacity + 1];
+};
+
+template<typename Leaf, typename Value, bool if_const>
+class BPlusTreeIterator {
+    using ref = std::conditional_t<if_const, const Value &, Value &>;
+    using ptr = std::conditional_t<if_const, const Value *, Value *>;
+
+    using Self = BPlusTreeIterator<Leaf, Value, if_const>;
+public:
+
+    Leaf * leaf;
+    size_t pos;
+
+    BPlusTreeIterator(Leaf * leaf_, size_t pos_) : leaf(leaf_), pos(pos_) {}
+
+    ref operator *() const {
+        return leaf->values[pos];
+    }
+
+    ptr operator ->() const {
+        return &(*(*this));
+    }
+
+    /// The leaves are linked, so a scan never goes up the tree.
+    Self & operator ++() {
+        if (leaf == nullptr) {
+            throw "the pointer is pointing to the end of tree.";
+        }
+
+        if (++pos == leaf->count) {
+            leaf = leaf->next;
+            pos = 0;
+        }
+        return *this;
+    }
+
+    Self operator ++(int) {
+        Self old = *this;
+        ++(*this);
+        return old;
+    }
+
+    bool operator == (const Self & rhs) const {
+        return leaf == rhs.leaf && pos == rhs.pos;
+    }
+
+    bool operator != (const Self & rhs) const {
+        return !(*this == rhs);
+    }
+};
+
+/** The B+tree with the interface of BinarySearchTree, so that it can be used as the `TreeType` of `toy::map`.
+  * The nodes are `node_bytes` large with the keys stored contiguously, and all values live in the linked leaves.
+  * `erase` doesn't merge half empty nodes, a node is only removed when it becomes empty.
+  * The keys and the values are moved between the slots of the nodes with memmove and are never destroyed, so they must be plain bytes,
+  *  like `int` or `std::pair<int, int>`.
+  */
+template<typename Key, typename Compare, typename Value, typename KeyOfValue = Select1ST<Key, Value>, typename Allocator = StepAllocator<true>, size_t node_bytes = 256>
+class BPlusTree : public Allocator
+{
+    static_assert(std::is_trivially_copy_constructible_v<Key> && std::is_trivially_destructible_v<Key>
+        && std::is_trivially_copy_constructible_v<Value> && std::is_trivially_destructible_v<Value>,
+        "BPlusTree copies the keys and the values as bytes, use BinarySearchTree or RedBlackTree for the other types");
+
+    using Leaf = BPlusTreeLeaf<Key, Value, node_bytes>;
+    using Inner = BPlusTreeInner<Key, node_bytes>;
+
+    static constexpr size_t max_height = 32;
+
+public:
+    using iterator = BPlusTreeIterator<Leaf, Value, false>;
+    using const_iterator = BPlusTreeIterator<Leaf, Value, true>;
+
+private:
+    /// The root is a leaf when the height is 1.
+    void * root;
+    size_t height;
+
+    Compare compare_op;
+
+    KeyOfValue key_of_value;
+
+    /// The path from the root to a leaf, `pos[i]` is the child taken in `nodes[i]`.
+    struct Path {
+        Inner * nodes[max_height];
+        size_t pos[max_height];
+    };
+
+    /// The number of keys in `keys` which are not greater than `key`, that is the child to go to.
+    size_t upperBound(const Key * keys, size_t count, const Key & key) const {
+        return std::upper_bound(keys, keys + count, key, compare_op) - keys;
+    }
+
+    size_t lowerBound(const Key * keys, size_t count, const Key & key) const {
+        return std::lower_bound(keys, keys + count, key, compare_op) - keys;
+    }
+
+    bool equals(const Key & lhs, const Key & rhs) const {
+        return !compare_op(lhs, rhs) && !compare_op(rhs, lhs);
+    }
+
+    Leaf * findLeaf(const Key & key, Path * path) const {
+        void * node = root;
+        for (size_t level = 0; level + 1 < height; level++) {
+            Inner * inner = static_cast<Inner *>(node);
+            size_t pos = upperBound(inner->keys, inner->count, key);
+            if (path) {
+                path->nodes[level] = inner;
+                path->pos[level] = pos;
+            }
+            node = inner->children[pos];
+        }
+        return static_cast<Leaf *>(node);
+    }
+
+    Leaf * createLeaf() {
+        Leaf * leaf = static_cast<Leaf *>(Allocator::alloc(sizeof(Leaf)));
+        leaf->count = 0;
+        leaf->prev = nullptr;
+        leaf->next = nullptr;
+        return leaf;
+    }
+
+    Inner * createInner() {
+        Inner * inner = static_cast<Inner *>(Allocator::alloc(sizeof(Inner)));
+        inner->count = 0;
+        return inner;
+    }
+
+    /// Insert `key` and the new right child `child` after the position `pos` of the node on `level`, splitting up to the root if needed.
+    void insertIntoParent(Path & path, size_t level, Key key, void * child) {
+        for (;;) {
+            if (level == 0 && path.nodes[0] == nullptr) {
+                /// The root has been split, grow the tree.
+                Inner * new_root = createInner();
+                new_root->count = 1;
+                new_root->keys[0] = key;
+                new_root->children[0] = root;
+                new_root->children[1] = child;
+                root = new_root;
+                height++;
+                return;
+            }
+
+            Inner * inner = path.nodes[level];
+            size_t pos = path.pos[level];
+
+            if (inner->count < Inner::capacity) {
+                memmove(&inner->keys[pos + 1], &inner->keys[pos], (inner->count - pos) * sizeof(Key));
+                memmove(&inner->children[pos + 2], &inner->children[pos + 1], (inner->count - pos) * sizeof(void *));
+                inner->keys[pos] = key;
+                inner->children[pos + 1] = child;
+                inner->count++;
+                return;
+            }
+
+            /// Split the full node: the middle key goes up, the right half moves to a new node.
+            Key keys[Inner::capacity + 1];
+            void * children[Inner::capacity + 2];
+            memcpy(keys, inner->keys, pos * sizeof(Key));
+            keys[pos] = key;
+            memcpy(keys + pos + 1, inner->keys + pos, (inner->count - pos) * sizeof(Key));
+            memcpy(children, inner->children, (pos + 1) * sizeof(void *));
+            children[pos + 1] = child;
+            memcpy(children + pos + 2, inner->children + pos + 1, (inner->count - pos) * sizeof(void *));
+
+            size_t total = Inner::capacity + 1;
+            size_t left_count = total / 2;
+            Inner * right = createInner();
+            inner->count = left_count;
+            memcpy(inner->keys, keys, left_count * sizeof(Key));
+            memcpy(inner->children, children, (left_count + 1) * sizeof(void *));
+            right->count = total - left_count - 1;
+            memcpy(right->keys, keys + left_count + 1, right->count * sizeof(Key));
+            memcpy(right->children, children + left_count + 1, (right->count + 1) * sizeof(void *));
+
+            key = keys[left_count];
+            child = right;
+            if (level == 0) {
+                path.nodes[0] = nullptr;
+            } else {
+                level--;
+            }
+        }
+    }
+
+    /// Remove the child `pos` of the node on `level` with the key in front of it, removing the emptied nodes up to the root.
+    void removeFromParent(Path & path, size_t level) {
+        for (;;) {
+            Inner * inner = path.nodes[level];
+            size_t pos = path.pos[level];
+
+            if (inner->count == 0) {
+                /// The only child is gone, so the node goes too.
+                Allocator::free(inner, sizeof(Inner));
+                if (level == 0) {
+                    root = createLeaf();
+                    height = 1;
+                    return;
+                }
+                level--;
+                continue;
+            }
+
+            /// The key between the removed child and its neighbour is dropped.
+            size_t key_pos = pos == 0 ? 0 : pos - 1;
+            memmove(&inner->keys[key_pos], &inner->keys[key_pos + 1], (inner->count - key_pos - 1) * sizeof(Key));
+            memmove(&inner->children[pos], &inner->children[pos + 1], (inner->count - pos) * sizeof(void *));
+            inner->count--;
+
+            /// The root with a single child is not needed.
+            while (height > 1 && level == 0 && static_cast<Inner *>(root)->count == 0) {
+                Inner * old_root = static_cast<Inner *>(root);
+                root = old_root->children[0];
+                Allocator::free(old_root, sizeof(Inner));
+                height--;
+            }
+            return;
+        }
+    }
+
+    void freeSubtree(void * node, size_t level) {
+        if (level + 1 < height) {
+            Inner * inner = static_cast<Inner *>(node);
+            for (size_t i = 0; i <= inner->count; i++)
+                freeSubtree(inner->children[i], level + 1);
+            Allocator::free(inner, sizeof(Inner));
+        } else {
+            Allocator::free(node, sizeof(Leaf));
+        }
+    }
+
+    Leaf * leftMostLeaf() const {
+        void * node = root;
+        for (size_t level = 0; level + 1 < height; level++)
+            node = static_cast<Inner *>(node)->children[0];
+        return static_cast<Leaf *>(node);
+    }
+
+public:
+
+    BPlusTree() : root(nullptr), height(1) {
+        root = createLeaf();
+    }
+
+    ~BPlusTree() {
+        if constexpr (!Allocator::free_in_bulk)
+            freeSubtree(root, 0);
+    }
+
+    BPlusTree(const BPlusTree &) = delete;
+    BPlusTree & operator=(const BPlusTree &) = delete;
+
+    std::pair<iterator, bool> insert_unique(const Value & value) {
+        const Key & key = key_of_value(value);
+        Path path;
+        path.nodes[0] = nullptr;
+        Leaf * leaf = findLeaf(key, &path);
+
+        size_t pos = lowerBound(leaf->keys, leaf->count, key);
+        if (pos < leaf->count && equals(leaf->keys[pos], key))
+            return std::make_pair(iterator(leaf, pos), false);
+
+        if (leaf->count == Leaf::capacity) {
+            /// Split the leaf in halves and link the new one after it.
+            Leaf * right = createLeaf();
+            size_t left_count = Leaf::capacity / 2;
+            right->count = Leaf::capacity - left_count;
+            memcpy(right->keys, leaf->keys + left_count, right->count * sizeof(Key));
+            memcpy((void *)right->values, (void *)(leaf->values + left_count), right->count * sizeof(Value));
+            leaf->count = left_count;
+
+            right->next = leaf->next;
+            right->prev = leaf;
+            if (leaf->next)
+                leaf->next->prev = right;
+            leaf->next = right;
+
+            insertIntoParent(path, height >= 2 ? height - 2 : 0, right->keys[0], right);
+
+            if (pos > left_count) {
+                pos -= left_count;
+                leaf = right;
+            }
+        }
+
+        memmove(&leaf->keys[pos + 1], &leaf->keys[pos], (leaf->count - pos) * sizeof(Key));
+        memmove((void *)&leaf->values[pos + 1], (void *)&leaf->values[pos], (leaf->count - pos) * sizeof(Value));
+        leaf->keys[pos] = key;
+        ConstructHelper::CopyConstruct(&leaf->values[pos], value);
+        leaf->count++;
+
+        return std::make_pair(iterator(leaf, pos), true);
+    }
+
+    bool erase(const Key & key) {
+        Path path;
+        Leaf * leaf = findLeaf(key, &path);
+
+        size_t pos = lowerBound(leaf->keys, leaf->count, key);
+        if (pos == leaf->count || !equals(leaf->keys[pos], key))
+            return false;
+
+        memmove(&leaf->keys[pos], &leaf->keys[pos + 1], (leaf->count - pos - 1) * sizeof(Key));
+        memmove((void *)&leaf->values[pos], (void *)&leaf->values[pos + 1], (leaf->count - pos - 1) * sizeof(Value));
+        leaf->count--;
+
+        if (leaf->count == 0 && height > 1) {
+            if (leaf->prev)
+                leaf->prev->next = leaf->next;
+            if (leaf->next)
+                leaf->next->prev = leaf->prev;
+            Allocator::free(leaf, sizeof(Leaf));
+            removeFromParent(path, height - 2);
+        }
+
+        return true;
+    }
+
+    iterator find(const Key & key) {
+        Leaf * leaf = findLeaf(key, nullptr);
+        size_t pos = lowerBound(leaf->keys, leaf->count, key);
+        if (pos == leaf->count || !equals(leaf->keys[pos], key))
+            return end();
+        return iterator(leaf, pos);
+    }
+
+    const_iterator find(const Key & key) const {
+        Leaf * leaf = findLeaf(key, nullptr);
+        size_t pos = lowerBound(leaf->keys, leaf->count, key);
+        if (pos == leaf->count || !equals(leaf->keys[pos], key))
+            return end();
+        return const_iterator(leaf, pos);
+    }
+
+    iterator begin() {
+        Leaf * leaf = leftMostLeaf();
+        return leaf->count ? iterator(leaf, 0) : end();
+    }
+
+    const_iterator begin() const {
+        Leaf * leaf = leftMostLeaf();
+        return leaf->count ? const_iterator(leaf, 0) : end();
+    }
+
+    iterator end() {
+        return iterator(nullptr, 0);
+    }
+
+    const_iterator end() const {
+        return const_iterator(nullptr, 0);
+    }
+};
+
+} // namespace toy
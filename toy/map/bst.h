@@ -65,12 +65,12 @@ public:
 
 };
 
-template<typename Value, bool if_const>
+template<typename Value, bool if_const, typename Node = TreeNode<Value>>
 class IteratorImpl {
     using ref = std::conditional_t<if_const, const Value &, Value &>;
     using ptr = std::conditional_t<if_const, const Value *, Value *>;
 
-    using Self = IteratorImpl<Value, if_const>;
+    using Self = IteratorImpl<Value, if_const, Node>;
 public:
 
     TreeNodeBase * node;
@@ -78,7 +78,7 @@ public:
     IteratorImpl(TreeNodeBase * node_) :node(node_) {}
 
     ref operator *() const {
-        return static_cast<TreeNode<Value> *>(node)->value;
+        return static_cast<Node *>(node)->value;
     }
 
     ptr operator ->() const {
@@ -124,7 +124,7 @@ public:
 template<typename Key, typename Value>
 class Select1ST {
 public:
-    const Key & operator ()(const Value & value) {
+    const Key & operator ()(const Value & value) const {
         return value.first;
     }
 };
@@ -229,6 +229,22 @@ private:
         Allocator::free((void*)node, sizeof(TreeNode<Value>));
     }
 
+    /// Rotate the left children up while freeing, so that a degenerated tree doesn't need a deep stack.
+    void freeSubtree(BasePtr node) {
+        while (node != nullptr) {
+            if (node -> left != nullptr) {
+                BasePtr left = node -> left;
+                node -> left = left -> right;
+                left -> right = node;
+                node = left;
+            } else {
+                BasePtr right = node -> right;
+                freeNode(node);
+                node = right;
+            }
+        }
+    }
+
     NodePtr createNode(const Value & value) {
         NodePtr ptr = (NodePtr)Allocator::alloc(sizeof(TreeNode<Value>));
         ConstructHelper::CopyConstruct(&ptr -> value, value);
@@ -241,6 +257,15 @@ public:
         header.parent = & header;
     }
 
+    /// An allocator which frees in bulk releases all nodes by itself.
+    ~BinarySearchTree() {
+        if constexpr (!Allocator::free_in_bulk)
+            freeSubtree(root());
+    }
+
+    BinarySearchTree(const BinarySearchTree &) = delete;
+    BinarySearchTree & operator=(const BinarySearchTree &) = delete;
+
     std::pair<iterator, bool> insert_unique(const Value & value) {
         NodePtr node = createNode(value);
         if (nullptr == root()) {
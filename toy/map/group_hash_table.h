@@ -0,0 +1,355 @@
+#pragma once
+
+#include "alloc.h"
+#include "hash.h"
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace toy {
+
+/** The layout of a Swiss table. Next to the cells there is an array of 1-byte control tags, one per cell.
+  * A tag is zero for an empty cell, one for a deleted cell and 0x80 | (7 bits of the hash) for a full cell,
+  *  so a zero filled buffer is an empty table.
+  * The tags are probed in aligned groups of 16 with one SSE2 compare, and a key is only touched when its tag matches.
+  */
+namespace GroupCtrl
+{
+    static constexpr uint8_t empty = 0;
+    static constexpr uint8_t deleted = 1;
+    static constexpr uint8_t full = 0x80;
+
+    static constexpr size_t group_size = 16;
+}
+
+/// The mask of the cells of a group with some property, bit i stands for the cell i of the group.
+struct GroupMask
+{
+    uint32_t mask;
+
+    explicit operator bool() const { return mask != 0; }
+
+    size_t lowest() const { return __builtin_ctz(mask); }
+
+    void clearLowest() { mask &= mask - 1; }
+};
+
+struct Group
+{
+#if defined(__SSE2__)
+    __m128i ctrl;
+
+    explicit Group(const uint8_t * pos) : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pos))) {}
+
+    GroupMask match(uint8_t tag) const
+    {
+        return GroupMask{static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), ctrl)))};
+    }
+
+    GroupMask matchEmpty() const { return match(GroupCtrl::empty); }
+
+    /// The high bit of the tag is set only for the full cells.
+    GroupMask matchEmptyOrDeleted() const
+    {
+        return GroupMask{~static_cast<uint32_t>(_mm_movemask_epi8(ctrl)) & 0xFFFF};
+    }
+#else
+    const uint8_t * ctrl;
+
+    explicit Group(const uint8_t * pos) : ctrl(pos) {}
+
+    GroupMask match(uint8_t tag) const
+    {
+        uint32_t res = 0;
+        for (size_t i = 0; i < GroupCtrl::group_size; ++i)
+            res |= uint32_t(ctrl[i] == tag) << i;
+        return GroupMask{res};
+    }
+
+    GroupMask matchEmpty() const { return match(GroupCtrl::empty); }
+
+    GroupMask matchEmptyOrDeleted() const
+    {
+        uint32_t res = 0;
+        for (size_t i = 0; i < GroupCtrl::group_size; ++i)
+            res |= uint32_t(!(ctrl[i] & GroupCtrl::full)) << i;
+        return GroupMask{res};
+    }
+#endif
+};
+
+template <size_t initial_size_degree = 8>
+struct GroupHashTableGrower
+{
+    static_assert(initial_size_degree >= 4, "the table must hold at least one group");
+
+    int8_t size_degree = initial_size_degree;
+
+    /// The size of the hash table in the cells.
+    size_t bufSize() const               { return 1ULL << size_degree; }
+
+    /// The tags let a miss stop at the first group with an empty cell, so the table can be filled up to 7/8.
+    size_t maxFill() const               { return bufSize() - bufSize() / 8; }
+    size_t groupMask() const             { return (bufSize() / GroupCtrl::group_size) - 1; }
+
+    /// From the hash value, get the group number in the hash table. The low 7 bits go to the tag.
+    size_t place(size_t x) const         { return (x >> 7) & groupMask(); }
+
+    /// The next group in the collision resolution chain, triangular probing visits every group once.
+    size_t next(size_t pos, size_t probe_num) const { return (pos + probe_num) & groupMask(); }
+
+    bool overflow(size_t elems) const    { return elems > maxFill(); }
+
+    void increaseSize()
+    {
+        size_degree += 1;
+    }
+};
+
+template <class Container_, typename Value, bool is_const>
+class group_iterator_base
+{
+    using Container = std::conditional_t<is_const, const Container_, Container_>;
+    using value_type = std::conditional_t<is_const, const Value, Value>;
+
+    using Self = group_iterator_base<Container_, Value, is_const>;
+
+    Container * container;
+    size_t pos;
+
+public:
+    group_iterator_base() {}
+    group_iterator_base(Container * container_, size_t pos_) : container(container_), pos(pos_) {}
+
+    bool operator== (const group_iterator_base & rhs) const { return pos == rhs.pos; }
+    bool operator!= (const group_iterator_base & rhs) const { return pos != rhs.pos; }
+
+    Self & operator++()
+    {
+        ++pos;
+        while (pos < container->grower.bufSize() && !(container->ctrl[pos] & GroupCtrl::full))
+            ++pos;
+        return (*this);
+    }
+
+    Self operator ++(int)
+    {
+        Self ret = *this;
+        ++(*this);
+        return ret;
+    }
+
+    value_type & operator* () const { return container->buf[pos]; }
+    value_type * operator->() const { return &container->buf[pos]; }
+};
+
+/** The hash table with the same interface as `HashTable`, so that it can be used as the `TreeType` of `toy::map`.
+  * `Cell` only provides the hash function and the value type, the values themselves are kept in a plain array.
+  */
+template<typename Key, typename Cell, typename Grower = GroupHashTableGrower<>, typename Allocator = StepAllocator<true>>
+class GroupHashTable : public Allocator
+{
+    using Hash = typename Cell::Hash;
+
+    using Self = GroupHashTable<Key, Cell, Grower, Allocator>;
+
+    using value_type = typename Cell::value_type;
+
+public:
+    class iterator : public group_iterator_base<Self, value_type, false> {
+    public:
+        using group_iterator_base<Self, value_type, false>::group_iterator_base;
+    };
+
+    class const_iterator : public group_iterator_base<Self, value_type, true> {
+    public:
+        using group_iterator_base<Self, value_type, true>::group_iterator_base;
+    };
+
+// FIXME:: friend class does not work in gcc :(
+public:
+    Grower grower;
+    uint8_t * ctrl;
+    value_type * buf;
+
+private:
+    Hash hash;
+
+    size_t size;
+
+    /// Full and deleted cells, a miss stops only at an empty one.
+    size_t used;
+
+    /// `std::hash` is the identity for integers, mix the bits so that both the group number and the tag are random.
+    static size_t mixHash(size_t x) { return intHash64(x); }
+
+    static uint8_t tagOf(size_t hash_value) { return GroupCtrl::full | (hash_value & 0x7F); }
+
+    /// Find the cell with the key, or return bufSize() if there is no such key.
+    size_t findCell(const Key & x, size_t hash_value) const
+    {
+        uint8_t tag = tagOf(hash_value);
+        size_t group = grower.place(hash_value);
+        for (size_t probe_num = 1;; ++probe_num)
+        {
+            size_t offset = group * GroupCtrl::group_size;
+            Group g(ctrl + offset);
+            for (GroupMask m = g.match(tag); m; m.clearLowest())
+            {
+                size_t pos = offset + m.lowest();
+                if (Cell::getKey(buf[pos]) == x)
+                    return pos;
+            }
+            if (g.matchEmpty())
+                return grower.bufSize();
+            group = grower.next(group, probe_num);
+        }
+    }
+
+    /// Find the first empty or deleted cell in the collision resolution chain of the hash value.
+    size_t findInsertableCell(size_t hash_value) const
+    {
+        size_t group = grower.place(hash_value);
+        for (size_t probe_num = 1;; ++probe_num)
+        {
+            size_t offset = group * GroupCtrl::group_size;
+            GroupMask m = Group(ctrl + offset).matchEmptyOrDeleted();
+            if (m)
+                return offset + m.lowest();
+            group = grower.next(group, probe_num);
+        }
+    }
+
+    void alloc(const Grower & new_grower)
+    {
+        ctrl = reinterpret_cast<uint8_t *>(Allocator::alloc(new_grower.bufSize()));
+        memset(ctrl, GroupCtrl::empty, new_grower.bufSize());
+        buf = reinterpret_cast<value_type *>(Allocator::alloc(new_grower.bufSize() * sizeof(value_type)));
+        grower = new_grower;
+    }
+
+    /// Rehash into a new buffer. The deleted cells are dropped, so the size is only increased if the table is really full.
+    void resize()
+    {
+        Grower new_grower = grower;
+        if (grower.overflow(size * 2))
+            new_grower.increaseSize();
+
+        uint8_t * old_ctrl = ctrl;
+        value_type * old_buf = buf;
+        size_t old_size = grower.bufSize();
+
+        alloc(new_grower);
+        used = size;
+
+        for (size_t i = 0; i < old_size; ++i)
+        {
+            if (!(old_ctrl[i] & GroupCtrl::full))
+                continue;
+            size_t hash_value = mixHash(hash(Cell::getKey(old_buf[i])));
+            size_t pos = findInsertableCell(hash_value);
+            ctrl[pos] = tagOf(hash_value);
+            memcpy((void *)&buf[pos], (void *)&old_buf[i], sizeof(value_type));
+        }
+
+        Allocator::free(old_ctrl, old_size);
+        Allocator::free(old_buf, old_size * sizeof(value_type));
+    }
+
+public:
+
+    GroupHashTable()
+    {
+        size = 0;
+        used = 0;
+        alloc(grower);
+    }
+
+    ~GroupHashTable()
+    {
+        Allocator::free(ctrl, grower.bufSize());
+        Allocator::free(buf, grower.bufSize() * sizeof(value_type));
+    }
+
+    GroupHashTable(const GroupHashTable &) = delete;
+    GroupHashTable & operator=(const GroupHashTable &) = delete;
+
+    std::pair<iterator, bool> insert_unique(const value_type & x)
+    {
+        size_t hash_value = mixHash(hash(Cell::getKey(x)));
+        size_t pos = findCell(Cell::getKey(x), hash_value);
+        if (pos != grower.bufSize())
+            return std::make_pair(iterator(this, pos), false);
+
+        pos = findInsertableCell(hash_value);
+        if (ctrl[pos] == GroupCtrl::empty && grower.overflow(used + 1)) {
+            resize();
+            pos = findInsertableCell(hash_value);
+        }
+
+        if (ctrl[pos] == GroupCtrl::empty)
+            ++used;
+        ctrl[pos] = tagOf(hash_value);
+        new(&buf[pos]) value_type(x);
+        ++size;
+
+        return std::make_pair(iterator(this, pos), true);
+    }
+
+    /** A group which has an empty cell now has never been full, so no collision resolution chain goes through it,
+      *  and the cell can become empty again. Otherwise it is marked as deleted.
+      */
+    bool erase(const Key & key)
+    {
+        size_t pos = findCell(key, mixHash(hash(key)));
+        if (pos == grower.bufSize())
+            return false;
+
+        size_t offset = pos - pos % GroupCtrl::group_size;
+        if (Group(ctrl + offset).matchEmpty()) {
+            ctrl[pos] = GroupCtrl::empty;
+            --used;
+        } else {
+            ctrl[pos] = GroupCtrl::deleted;
+        }
+        --size;
+
+        return true;
+    }
+
+    iterator find(const Key & x)
+    {
+        return iterator(this, findCell(x, mixHash(hash(x))));
+    }
+
+    const_iterator find(const Key & x) const
+    {
+        return const_iterator(this, findCell(x, mixHash(hash(x))));
+    }
+
+    const_iterator begin() const
+    {
+        size_t pos = 0;
+        while (pos < grower.bufSize() && !(ctrl[pos] & GroupCtrl::full))
+            ++pos;
+        return const_iterator(this, pos);
+    }
+
+    iterator begin()
+    {
+        size_t pos = 0;
+        while (pos < grower.bufSize() && !(ctrl[pos] & GroupCtrl::full))
+            ++pos;
+        return iterator(this, pos);
+    }
+
+    const_iterator end() const         { return const_iterator(this, grower.bufSize()); }
+    iterator end()                     { return iterator(this, grower.bufSize()); }
+};
+
+}
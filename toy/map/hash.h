@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+/** `std::hash` is the identity for integers, and the hash tables take the low bits of the hash for the place, so keys with a common
+  *  stride like `i * 1000 + 500` fall into a few places and make long chains. These hashes mix all bits of `std::hash` into the low ones,
+  *  pass any of them as `Hash_` of a cell.
+  */
+
+namespace toy {
+
+/// The finalizer of MurmurHash3, each bit of the input flips each bit of the result with probability close to 1/2.
+inline uint64_t intHash64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/// The mixing step of wyhash: one 64x64->128 bit multiplication, the two halves xored together.
+inline uint64_t wyHash64(uint64_t x)
+{
+    __uint128_t res = __uint128_t(x ^ 0xa0761d6478bd642fULL) * (x ^ 0xe7037ed1a0b428dbULL);
+    return uint64_t(res) ^ uint64_t(res >> 64);
+}
+
+/// Eight tables of CRC32C with the reflected Castagnoli polynomial, `table[k][b]` is the CRC of byte `b` followed by `k` zero bytes.
+struct CRC32Tables
+{
+    uint32_t table[8][256] = {};
+
+    constexpr CRC32Tables()
+    {
+        for (uint32_t b = 0; b < 256; ++b)
+        {
+            uint32_t crc = b;
+            for (size_t i = 0; i < 8; ++i)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            table[0][b] = crc;
+        }
+        for (size_t k = 1; k < 8; ++k)
+            for (size_t b = 0; b < 256; ++b)
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+    }
+};
+
+inline constexpr CRC32Tables crc32_tables;
+
+/// CRC32C of the 8 bytes, one instruction with SSE4.2 (build with -msse4.2). The result has 32 bits, enough for the place in a table.
+inline uint64_t intHashCRC32(uint64_t x)
+{
+#if defined(__SSE4_2__)
+    return _mm_crc32_u64(-1ULL, x);
+#else
+    /// The same function by slicing-by-8: one table lookup per byte instead of a step per bit.
+    const auto & t = crc32_tables.table;
+    uint32_t lo = uint32_t(x) ^ 0xFFFFFFFF;
+    uint32_t hi = uint32_t(x >> 32);
+    return t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+        ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+#endif
+}
+
+template <typename Key>
+struct MurmurHash
+{
+    size_t operator()(const Key & key) const { return intHash64(std::hash<Key>()(key)); }
+};
+
+template <typename Key>
+struct WyHash
+{
+    size_t operator()(const Key & key) const { return wyHash64(std::hash<Key>()(key)); }
+};
+
+template <typename Key>
+struct CRC32Hash
+{
+    size_t operator()(const Key & key) const { return intHashCRC32(std::hash<Key>()(key)); }
+};
+
+}
@@ -1,5 +1,18 @@
+#pragma once
+
 #include "alloc.h"
 #include <cstring>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <iostream>
 
@@ -21,9 +34,34 @@ struct ZeroStorage {
     Cell zero_storage;
 };
 
-template <size_t initial_size_degree = 8>
+/// The chain goes to the adjacent cell. The chains are contiguous, which the backward shift erase and the in place resize rely on.
+struct LinearProbing
+{
+    static constexpr bool linear = true;
+
+    static size_t next(size_t pos, size_t /*probe_num*/, size_t mask) { return (pos + 1) & mask; }
+};
+
+/** The chain jumps by 1, 2, 3, ... cells, so the offsets from the place are the triangular numbers, which visit every cell
+  *  of a power of two buffer once. The chains of neighbouring places don't merge into one long run like with linear probing.
+  */
+struct QuadraticProbing
+{
+    static constexpr bool linear = false;
+
+    static size_t next(size_t pos, size_t probe_num, size_t mask) { return (pos + probe_num) & mask; }
+};
+
+/** `max_fill_percent` trades memory for the length of the chains: with linear probing a miss at 90% takes ~50 probes against ~2.5 at 50%.
+  * `Probing` is the policy of the collision resolution chain, `LinearProbing` or `QuadraticProbing`.
+  */
+template <size_t initial_size_degree = 8, size_t max_fill_percent = 50, typename Probing = LinearProbing>
 struct HashTableGrower
 {
+    static_assert(max_fill_percent > 0 && max_fill_percent < 100, "the table must keep some empty cells to end the chains");
+
+    static constexpr bool linear_probing = Probing::linear;
+
     /// The state of this structure is enough to get the buffer size of the hash table.
 
     int8_t size_degree = initial_size_degree;
@@ -31,15 +69,20 @@ struct HashTableGrower
     /// The size of the hash table in the cells.
     size_t bufSize() const               { return 1ULL << size_degree; }
 
-    size_t maxFill() const               { return 1ULL << (size_degree - 1); }
+    static size_t maxFill(size_t degree) { return (1ULL << degree) / 100 * max_fill_percent + (1ULL << degree) % 100 * max_fill_percent / 100; }
+
+    size_t maxFill() const               { return maxFill(size_degree); }
     size_t mask() const                  { return bufSize() - 1; }
 
     /// From the hash value, get the cell number in the hash table.
     size_t place(size_t x) const         { return x & mask(); }
 
-    /// The next cell in the collision resolution chain.
+    /// The cell after `pos`, which is the next cell of the chain only with linear probing.
     size_t next(size_t pos) const        { ++pos; return pos & mask(); }
 
+    /// The next cell in the collision resolution chain, `probe_num` is the number of the probe starting from 1.
+    size_t next(size_t pos, size_t probe_num) const { return Probing::next(pos, probe_num, mask()); }
+
     /// Whether the hash table is sufficiently full. You need to increase the size of the hash table, or remove something unnecessary from it.
     bool overflow(size_t elems) const    { return elems > maxFill(); }
 
@@ -51,6 +94,38 @@ struct HashTableGrower
     }
 
     /// Set the buffer size by the number of elements in the hash table. Used when deserializing a hash table.
+    void set(size_t num_elems)
+    {
+        /// The smallest degree whose maxFill() is not less than `num_elems`.
+        size_t degree = 1;
+        while (maxFill(degree) < num_elems)
+            ++degree;
+        size_degree = std::max<size_t>(initial_size_degree, degree);
+    }
+
+    /// Set the buffer size to at least `num_cells`, rounded up to a power of two.
+    void setBufSize(size_t num_cells)
+    {
+        size_t degree = 1;
+        while ((1ULL << degree) < num_cells)
+            ++degree;
+        size_degree = std::max<size_t>(initial_size_degree, degree);
+    }
+
+    /// How many threads rehash the cells into a new buffer on resize. Zero means the cells are rehashed in place by the resizer.
+    static constexpr size_t resize_threads = 0;
+};
+
+/** The grower of a table whose resize rehashes the cells into a new buffer on `threads` threads.
+  * The old buffer is split at empty cells, so that every chain is moved by a single thread in the order of the serial rehash,
+  *  and the new buffer is the same as with one thread.
+  */
+template <size_t threads, size_t initial_size_degree = 8, size_t max_fill_percent = 50>
+struct ParallelHashTableGrower : public HashTableGrower<initial_size_degree, max_fill_percent>
+{
+    static_assert(threads > 0, "the resize needs a thread");
+
+    static constexpr size_t resize_threads = threads;
 };
 
 template <typename Key, typename TMapped, typename Hash_ = std::hash<Key>>
@@ -94,12 +169,65 @@ struct HashMapCell
     /// Do I need to store the zero key separately (that is, can a zero key be inserted into the hash table).
     static constexpr bool need_zero_value_storage = true;
 
+    /// Whether `erase` leaves a deleted mark in the cell instead of shifting the following cells back.
+    static constexpr bool use_tombstones = true;
+
     /// Whether the cell was deleted.
     bool isDeleted() const { return deleted;}
 
     void setDeleted() {deleted = true;}
 
     void setMapped(const value_type & value_) { value.second = value_.second; }
+
+    /// The cells which save the hash value get it here after the construction, `getHash` returns it then.
+    void setHash(size_t /*hash_value*/) {}
+};
+
+/** The cell without the `deleted` flag. `erase` shifts the rest of the collision resolution chain back into the hole,
+  *  so a chain never contains anything but live cells. Works with linear probing only.
+  */
+template <typename Key, typename TMapped, typename Hash_ = std::hash<Key>>
+struct BackwardShiftHashMapCell
+{
+    using Mapped = TMapped;
+
+    using Hash = Hash_;
+
+    using value_type = std::pair<Key, Mapped>;
+
+    value_type value;
+
+    BackwardShiftHashMapCell() {}
+    BackwardShiftHashMapCell(const value_type & value_) : value(value_) {}
+
+    value_type & getValue() { return value; }
+    const value_type & getValue() const { return value; }
+
+    static Key & getKey(value_type & value) { return value.first; }
+    static const Key & getKey(const value_type & value) { return value.first; }
+
+    bool keyEquals(const Key & key_) const { return value.first == key_; }
+
+    size_t getHash(const Hash & hash) const { return hash(value.first); }
+
+    bool isZero() const { return ZeroTraits::check(value.first); }
+
+    static bool isZero(const Key & key) { return ZeroTraits::check(key); }
+
+    bool isInsertable() const {return isZero();}
+
+    /// Set the key value to zero.
+    void setZero() { ZeroTraits::set(value.first); }
+
+    static constexpr bool need_zero_value_storage = true;
+
+    static constexpr bool use_tombstones = false;
+
+    bool isDeleted() const { return false; }
+
+    void setMapped(const value_type & value_) { value.second = value_.second; }
+
+    void setHash(size_t /*hash_value*/) {}
 };
 
 template <class Container_, typename Cell, bool is_const>
@@ -144,6 +272,51 @@ public:
     auto * operator->() const { return &ptr->getValue(); }
 };
 
+/** The file written by `HashTable::write`. The header and the zero cell fill the first `size` bytes,
+  *  then the raw cells follow, so that they can be mapped with an offset aligned to the page.
+  */
+namespace HashTableFile
+{
+    static constexpr uint64_t magic = 0x3242415448594f54ULL; /// "TOYHTAB2"
+    static constexpr size_t header_size = 4096;
+
+    struct Header
+    {
+        uint64_t magic;
+        uint64_t cell_size;
+        uint64_t size;
+        uint64_t deleted_cells;
+        int8_t size_degree;
+        uint8_t has_zero;
+    };
+
+    inline void writeAll(int fd, const void * data, size_t n)
+    {
+        const char * pos = static_cast<const char *>(data);
+        while (n > 0)
+        {
+            ssize_t res = ::write(fd, pos, n);
+            if (res < 0)
+                throw "cannot write hash table";
+            pos += res;
+            n -= res;
+        }
+    }
+
+    inline void readAll(int fd, void * data, size_t n)
+    {
+        char * pos = static_cast<char *>(data);
+        while (n > 0)
+        {
+            ssize_t res = ::read(fd, pos, n);
+            if (res <= 0)
+                throw "cannot read hash table";
+            pos += res;
+            n -= res;
+        }
+    }
+}
+
 template<typename Key, typename Cell, typename Grower = HashTableGrower<>, typename Allocator = StepAllocator<true>>
 class HashTable : public ZeroStorage<Cell>, public Allocator
 {
@@ -180,17 +353,101 @@ private:
         place_value = findCell(Cell::getKey(x.getValue()), place_value);
 
         /// If the item remains in its place in the old collision resolution chain.
-        if (!buf[place_value].isZero())
+        if (!buf[place_value].isInsertable())
             return;
 
+        if (buf[place_value].isDeleted())
+            --deleted_cells;
+
         /// Copy to a new location and zero the old one.
-        memcpy(&buf[place_value], &x, sizeof(x));
+        memcpy((void *)&buf[place_value], (void *)&x, sizeof(x));
         x.setZero();
 
         /// Then the elements that previously were in collision with this can move to the old place.
     }
 
 
+    /// The cells a thread of the parallel resize takes at least, small tables are rehashed on fewer threads.
+    static constexpr size_t min_resize_cells_per_thread = 1 << 16;
+
+    /// Rehash the cells of `buf` in [begin, end) into `new_buf`.
+    void rehashRange(size_t begin, size_t end, Cell * new_buf, const Grower & new_grower)
+    {
+        for (size_t i = begin; i < end; ++i)
+            if (!buf[i].isZero() && !buf[i].isDeleted())
+            {
+                size_t place_value = findCell(Cell::getKey(buf[i].getValue()), new_grower.place(buf[i].getHash(hash)), new_buf, new_grower);
+                memcpy((void *)&new_buf[place_value], (void *)&buf[i], sizeof(Cell));
+            }
+    }
+
+    /** Rehash into a new buffer on `Grower::resize_threads` threads.
+      * With linear probing the cells of a chain of the old buffer land only in the images of that chain in the new buffer,
+      *  so the ranges which start at an empty cell are rehashed independently. The only chain which crosses the ranges is the one
+      *  wrapping around the end of the old buffer, its tail is taken by the first thread after the first range, in the serial order.
+      */
+    void resizeParallel(size_t old_size, const Grower & new_grower)
+    {
+        Cell * new_buf = reinterpret_cast<Cell *>(Allocator::alloc(new_grower.bufSize() * sizeof(Cell)));
+        size_t num_threads = std::max<size_t>(1, std::min(Grower::resize_threads, old_size / min_resize_cells_per_thread));
+
+        std::vector<size_t> bounds(num_threads + 1, old_size);
+        bounds[0] = 0;
+        for (size_t t = 1; t < num_threads; ++t)
+        {
+            size_t bound = std::max(old_size / num_threads * t, bounds[t - 1]);
+            while (bound < old_size && !buf[bound].isZero())
+                ++bound;
+            bounds[t] = bound;
+        }
+
+        /// The empty cell before the chain which wraps around.
+        size_t tail = old_size;
+        if (num_threads > 1)
+            while (tail > bounds[num_threads - 1] && !buf[tail - 1].isZero())
+                --tail;
+
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < num_threads; ++t)
+            workers.emplace_back([&, t] { rehashRange(bounds[t], t + 1 == num_threads ? tail : bounds[t + 1], new_buf, new_grower); });
+        rehashRange(0, bounds[1], new_buf, new_grower);
+        rehashRange(tail, old_size, new_buf, new_grower);
+        for (auto & worker : workers)
+            worker.join();
+
+        freeBuffer();
+        buf = new_buf;
+        grower = new_grower;
+        deleted_cells = 0;
+    }
+
+    /// Rehash the live cells into a new buffer of `new_grower`, the deleted cells are left behind.
+    void rehashCopy(const Grower & new_grower)
+    {
+        Cell * new_buf = reinterpret_cast<Cell *>(Allocator::alloc(new_grower.bufSize() * sizeof(Cell)));
+        for (size_t i = 0; i < grower.bufSize(); ++i)
+            if (!buf[i].isZero() && !buf[i].isDeleted())
+            {
+                size_t place_value = findCell(Cell::getKey(buf[i].getValue()), new_grower.place(buf[i].getHash(hash)), new_buf, new_grower);
+                memcpy((void *)&new_buf[place_value], (void *)&buf[i], sizeof(Cell));
+            }
+        freeBuffer();
+        buf = new_buf;
+        grower = new_grower;
+        deleted_cells = 0;
+    }
+
+    /** The deleted cells end the chains no more than the live ones do, so together they must stay under `maxFill()`,
+      *  or a miss finds no empty cell at all. Drop them by a rehash, which also grows the buffer if the live cells alone fill half of it.
+      */
+    void dropDeletedCells()
+    {
+        Grower new_grower = grower;
+        if (grower.overflow(size * 2))
+            new_grower.increaseSize();
+        rehashCopy(new_grower);
+    }
+
     void resize(size_t for_num_elems = 0, size_t for_buf_size = 0)
     {
 
@@ -203,10 +460,45 @@ private:
           */
         Grower new_grower = grower;
 
-        new_grower.increaseSize();
+        /// The cells are rehashed in place, so the buffer is never shrunk.
+        if (for_num_elems)
+        {
+            new_grower.set(for_num_elems);
+            if (new_grower.bufSize() <= old_size)
+                return;
+        }
+        else if (for_buf_size)
+        {
+            new_grower.setBufSize(for_buf_size);
+            if (new_grower.bufSize() <= old_size)
+                return;
+        }
+        else
+            new_grower.increaseSize();
+
+        /// Other chains are not contiguous, and the in place rehash below can break them. Rehash into a new buffer instead.
+        if constexpr (!Grower::linear_probing)
+        {
+            rehashCopy(new_grower);
+            return;
+        }
+
+        if constexpr (Grower::resize_threads != 0)
+        {
+            resizeParallel(old_size, new_grower);
+            return;
+        }
 
-        /// Expand the space.
-        buf = reinterpret_cast<Cell *>(Allocator::realloc(buf, getBufferSizeInBytes(), new_grower.bufSize() * sizeof(Cell)));
+        /// Expand the space. A mapped file can't be grown in place, the cells are copied to the memory of the allocator.
+        if (buf_mapped)
+        {
+            Cell * new_buf = reinterpret_cast<Cell *>(Allocator::alloc(new_grower.bufSize() * sizeof(Cell)));
+            memcpy((void *)new_buf, (void *)buf, getBufferSizeInBytes());
+            freeBuffer();
+            buf = new_buf;
+        }
+        else
+            buf = reinterpret_cast<Cell *>(Allocator::realloc(buf, getBufferSizeInBytes(), new_grower.bufSize() * sizeof(Cell)));
         grower = new_grower;
 
         /** Now some items may need to be moved to a new location.
@@ -236,6 +528,12 @@ private:
 
     size_t size;
 
+    /// The cells with the deleted mark, they are counted against `maxFill()` together with `size`.
+    size_t deleted_cells = 0;
+
+    /// Whether `buf` is a private mapping of a file made by `readMapped`, and not the memory of the allocator.
+    bool buf_mapped = false;
+
     using value_type = typename Cell::value_type;
 
     void emplaceNonZero(const value_type & value, iterator & it, bool & insert, size_t hash_value) {
@@ -246,13 +544,19 @@ private:
             insert = false;
             return;
         }
+        if (buf[place].isDeleted())
+            --deleted_cells;
         new(&buf[place]) Cell(value);
+        buf[place].setHash(hash_value);
         insert = true;
         size ++;
 
         //std::cout<<"size: "<<size<<std::endl;
-        if (grower.overflow(size)) {
-            resize();
+        if (grower.overflow(size + deleted_cells)) {
+            if (deleted_cells)
+                dropDeletedCells();
+            else
+                resize();
 
             it = find(key);
         }
@@ -278,16 +582,28 @@ private:
     /// Find a cell with the same key or an empty cell, starting from the specified position and further along the collision resolution chain.
     size_t findCell(const Key & x, size_t place_value) const
     {
+        return findCell(x, place_value, buf, grower);
+    }
+
+    size_t findCell(const Key & x, size_t place_value, const Cell * cur_buf, const Grower & cur_grower) const
+    {
+        size_t probe_num = 0;
+        if constexpr (!Cell::use_tombstones) {
+            while (!cur_buf[place_value].isZero() && !cur_buf[place_value].keyEquals(x))
+                place_value = cur_grower.next(place_value, ++probe_num);
+            return place_value;
+        }
+
         int64_t first_deleted_place = -1;
-        while (!buf[place_value].isZero() )
+        while (!cur_buf[place_value].isZero() )
         {
-            if(!buf[place_value].isDeleted() && buf[place_value].keyEquals(x)) {
+            if(!cur_buf[place_value].isDeleted() && cur_buf[place_value].keyEquals(x)) {
                 first_deleted_place = -1;
                 break;
             }
-            if (buf[place_value].isDeleted() && first_deleted_place == -1)
+            if (cur_buf[place_value].isDeleted() && first_deleted_place == -1)
                 first_deleted_place = place_value;
-            place_value = grower.next(place_value);
+            place_value = cur_grower.next(place_value, ++probe_num);
         }
 
         if (first_deleted_place == -1)
@@ -296,6 +612,114 @@ private:
             return (size_t)first_deleted_place;
     }
 
+    /** Fill the hole with the following cells of the chain. A cell may move back into the hole only if
+      *  the hole is not before its own place, that is the hole is in the cyclic range [place, cur).
+      */
+    void eraseWithBackwardShift(size_t hole)
+    {
+        static_assert(Grower::linear_probing, "backward shift needs the contiguous chains of linear probing, use a cell with tombstones");
+
+        for (size_t cur = grower.next(hole); !buf[cur].isZero(); cur = grower.next(cur))
+        {
+            size_t place_value = grower.place(buf[cur].getHash(hash));
+            if (((cur - place_value) & grower.mask()) >= ((cur - hole) & grower.mask()))
+            {
+                memcpy((void *)&buf[hole], (void *)&buf[cur], sizeof(Cell));
+                hole = cur;
+            }
+        }
+        buf[hole].setZero();
+    }
+
+    /// A cell of a source table of `merge` with its hash value, so that the key is hashed once.
+    struct MergeRow
+    {
+        const Cell * cell;
+        size_t hash_value;
+    };
+
+    /// The cells a partition of `merge` covers at least, small tables are merged in fewer partitions.
+    static constexpr size_t min_merge_cells_per_partition = 1 << 12;
+
+    /// Call `func(task)` for the tasks [0, num_tasks) on `num_threads` threads, a thread takes the next task when it is done with one.
+    template <typename Func>
+    static void runTasks(size_t num_threads, size_t num_tasks, Func && func)
+    {
+        std::atomic<size_t> next_task{0};
+        auto worker = [&]
+        {
+            for (size_t task = next_task.fetch_add(1); task < num_tasks; task = next_task.fetch_add(1))
+                func(task);
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < std::min(num_threads, num_tasks); ++i)
+            threads.emplace_back(worker);
+        worker();
+        for (auto & thread : threads)
+            thread.join();
+    }
+
+    /** Insert or merge the rows into the cells [begin, end) of the buffer, which no other thread touches.
+      * A row whose chain would run past `end` goes to `overflow`. Returns the number of the inserted keys.
+      */
+    template <typename Merge>
+    size_t mergeRange(const std::vector<MergeRow> & rows, size_t end, std::vector<MergeRow> & overflow, Merge & merge_fn)
+    {
+        size_t inserted = 0;
+        for (const MergeRow & row : rows)
+        {
+            const value_type & value = row.cell->getValue();
+            size_t place_value = grower.place(row.hash_value);
+            while (place_value < end && !buf[place_value].isZero()
+                && (buf[place_value].isDeleted() || !buf[place_value].keyEquals(Cell::getKey(value))))
+                ++place_value;
+
+            if (place_value == end)
+                overflow.push_back(row);
+            else if (buf[place_value].isZero())
+            {
+                new(&buf[place_value]) Cell(value);
+                buf[place_value].setHash(row.hash_value);
+                ++inserted;
+            }
+            else
+                merge_fn(buf[place_value].getValue().second, value.second);
+        }
+        return inserted;
+    }
+
+    /// The number of keys hashed ahead of the probes in `insert_batch` and `find_batch`.
+    static constexpr size_t batch_block_size = 256;
+
+    /// How many keys ahead the cell is prefetched. About the number of cache misses the memory system keeps in flight.
+    static constexpr size_t prefetch_distance = 8;
+
+    /** Hash a block of the items first, then call `func(i, hash_value)` for each of them in order,
+      *  prefetching the cell of the item `prefetch_distance` positions ahead.
+      */
+    template <typename Item, typename GetKey, typename Func>
+    void forEachHashed(const Item * items, size_t count, GetKey && get_key, Func && func) const
+    {
+        size_t hashes[batch_block_size];
+        for (size_t block_begin = 0; block_begin < count; block_begin += batch_block_size)
+        {
+            size_t block_size = std::min(batch_block_size, count - block_begin);
+            for (size_t i = 0; i < block_size; ++i)
+                hashes[i] = hash(get_key(items[block_begin + i]));
+
+            for (size_t i = 0; i < std::min(prefetch_distance, block_size); ++i)
+                __builtin_prefetch(&buf[grower.place(hashes[i])]);
+
+            for (size_t i = 0; i < block_size; ++i)
+            {
+                if (i + prefetch_distance < block_size)
+                    __builtin_prefetch(&buf[grower.place(hashes[i + prefetch_distance])]);
+                func(block_begin + i, hashes[i]);
+            }
+        }
+    }
+
     const_iterator iteratorTo(const Cell * ptr) const { return const_iterator(this, ptr); }
     iterator iteratorTo(Cell * ptr)                   { return iterator(this, ptr); }
     const_iterator iteratorToZero() const             { return iteratorTo(&this->zero_storage); }
@@ -312,6 +736,44 @@ private:
         return grower.bufSize() * sizeof(Cell);
     }
 
+    void freeBuffer()
+    {
+        if (buf_mapped)
+        {
+            if (0 != munmap(buf, getBufferSizeInBytes()))
+                throw "cannot unmap";
+            buf_mapped = false;
+        }
+        else
+            Allocator::free(buf, getBufferSizeInBytes());
+        buf = nullptr;
+    }
+
+    /// Read the header and the zero cell, check that the file was written by a table of the same type.
+    static HashTableFile::Header readHeader(int fd, Cell & zero_cell)
+    {
+        char header_buf[HashTableFile::header_size];
+        HashTableFile::readAll(fd, header_buf, HashTableFile::header_size);
+
+        HashTableFile::Header header;
+        memcpy(&header, header_buf, sizeof(header));
+        if (header.magic != HashTableFile::magic || header.cell_size != sizeof(Cell))
+            throw "bad hash table file";
+        /// The buffer size in bytes must fit `size_t`.
+        if (header.size_degree < 1 || header.size_degree > 62 || (1ULL << header.size_degree) > SIZE_MAX / sizeof(Cell))
+            throw "bad hash table file";
+
+        /// The cells in use stay under the max fill, as in the table which wrote them, or a miss would find no empty cell to stop at.
+        Grower file_grower;
+        file_grower.size_degree = header.size_degree;
+        if (header.size > file_grower.bufSize() || header.deleted_cells > file_grower.bufSize()
+            || file_grower.overflow(header.size + header.deleted_cells) || header.has_zero > 1)
+            throw "bad hash table file";
+
+        memcpy((void *)&zero_cell, header_buf + sizeof(header), sizeof(Cell));
+        return header;
+    }
+
 
 public:
 
@@ -322,6 +784,152 @@ public:
         alloc(grower);
     }
 
+    /// Allocate the buffer for `reserve_for_num_elements` elements at once.
+    explicit HashTable(size_t reserve_for_num_elements)
+    {
+        this->has_zero = false;
+        size = 0;
+        grower.set(reserve_for_num_elements);
+        alloc(grower);
+    }
+
+    /** Fill the table from the range in a single pass. The order of the values does not matter.
+      * If the length of the range is known beforehand, the buffer is allocated once and never resized.
+      */
+    template <typename InputIt>
+    HashTable(InputIt first, InputIt last)
+    {
+        this->has_zero = false;
+        size = 0;
+        if constexpr (std::is_base_of_v<std::forward_iterator_tag, typename std::iterator_traits<InputIt>::iterator_category>)
+            grower.set(std::distance(first, last));
+        alloc(grower);
+
+        for (; first != last; ++first)
+            insert_unique(*first);
+    }
+
+    ~HashTable()
+    {
+        freeBuffer();
+    }
+
+    HashTable(const HashTable &) = delete;
+    HashTable & operator=(const HashTable &) = delete;
+
+    /** Write the table to `fd`: the header with the zero cell, then the raw cells in one write.
+      * The table can be read back only by a table of the same type on a machine with the same byte order.
+      */
+    void write(int fd) const
+    {
+        static_assert(sizeof(HashTableFile::Header) + sizeof(Cell) <= HashTableFile::header_size, "the zero cell doesn't fit the header");
+        /// Pointers, like the keys of the string hash table in its arena, would be written as addresses, which mean nothing to the reader.
+        static_assert(std::is_trivially_copy_constructible_v<Cell> && std::is_trivially_destructible_v<Cell>
+            && std::is_scalar_v<Key> && !std::is_pointer_v<Key>, "only the cells of plain bytes with scalar keys can be written");
+
+        /// The padding of the header goes to the file too, so it is zeroed as well.
+        char header_buf[HashTableFile::header_size] = {};
+        HashTableFile::Header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = HashTableFile::magic;
+        header.cell_size = sizeof(Cell);
+        header.size = size;
+        header.deleted_cells = deleted_cells;
+        header.size_degree = grower.size_degree;
+        header.has_zero = this->has_zero;
+        memcpy(header_buf, &header, sizeof(header));
+        memcpy(header_buf + sizeof(header), &this->zero_storage, sizeof(Cell));
+
+        HashTableFile::writeAll(fd, header_buf, HashTableFile::header_size);
+        HashTableFile::writeAll(fd, buf, getBufferSizeInBytes());
+    }
+
+    /// Replace the content of the table with the one written by `write`. The cells are read into a buffer of the allocator, nothing is rehashed.
+    void read(int fd)
+    {
+        Cell zero_cell;
+        HashTableFile::Header header = readHeader(fd, zero_cell);
+
+        /// Read into a new buffer first, so that the table stays as it was if the read fails.
+        Grower new_grower;
+        new_grower.size_degree = header.size_degree;
+        size_t new_size_in_bytes = new_grower.bufSize() * sizeof(Cell);
+        Cell * new_buf = reinterpret_cast<Cell *>(Allocator::alloc(new_size_in_bytes));
+        try
+        {
+            HashTableFile::readAll(fd, new_buf, new_size_in_bytes);
+        }
+        catch (...)
+        {
+            Allocator::free(new_buf, new_size_in_bytes);
+            throw;
+        }
+
+        freeBuffer();
+        buf = new_buf;
+        grower = new_grower;
+        size = header.size;
+        deleted_cells = header.deleted_cells;
+        memcpy((void *)&this->zero_storage, (void *)&zero_cell, sizeof(Cell));
+        this->has_zero = header.has_zero;
+    }
+
+    /** Like `read`, but map the cells straight from the file, so the pages are loaded lazily by the first lookups.
+      * The mapping is private: the table can be changed, and the changes never go to the file.
+      * The file stays mapped until the table is resized or destroyed, closing `fd` is fine.
+      * If the cells are not at an offset aligned to the page, fall back to `read`.
+      */
+    void readMapped(int fd)
+    {
+        off_t header_offset = lseek(fd, 0, SEEK_CUR);
+        off_t cells_offset = header_offset + HashTableFile::header_size;
+        if (header_offset < 0 || cells_offset % sysconf(_SC_PAGESIZE) != 0)
+        {
+            read(fd);
+            return;
+        }
+
+        Cell zero_cell;
+        HashTableFile::Header header = readHeader(fd, zero_cell);
+
+        Grower new_grower;
+        new_grower.size_degree = header.size_degree;
+        size_t new_size_in_bytes = new_grower.bufSize() * sizeof(Cell);
+
+        /// A mapping past the end of the file maps fine, and raises SIGBUS on the first probe there.
+        struct stat file_stat;
+        if (0 != fstat(fd, &file_stat) || size_t(file_stat.st_size) < cells_offset + new_size_in_bytes)
+            throw "bad hash table file";
+
+        void * mapped = mmap(nullptr, new_size_in_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, cells_offset);
+        if (MAP_FAILED == mapped)
+            throw "cannot map hash table file";
+
+        freeBuffer();
+        buf = reinterpret_cast<Cell *>(mapped);
+        buf_mapped = true;
+        grower = new_grower;
+        size = header.size;
+        deleted_cells = header.deleted_cells;
+        memcpy((void *)&this->zero_storage, (void *)&zero_cell, sizeof(Cell));
+        this->has_zero = header.has_zero;
+
+        /// Leave the position after the table, as `read` does.
+        lseek(fd, cells_offset + new_size_in_bytes, SEEK_SET);
+    }
+
+    /// Make room for `num_elems` elements, so that inserting them doesn't resize the table.
+    void reserve(size_t num_elems)
+    {
+        resize(num_elems);
+    }
+
+    /// Grow the buffer to at least `num_cells` cells. The buffer is never shrunk.
+    void rehash(size_t num_cells)
+    {
+        resize(0, num_cells);
+    }
+
     /// Insert a value. In the case of any more complex values, it is better to use the `emplace` function.
     std::pair<iterator, bool> insert_unique(const value_type & x)
     {
@@ -334,18 +942,169 @@ public:
         return res;
     }
 
+    /** Insert `count` values. The keys are hashed ahead of the probes so that the cells can be prefetched.
+      * The table grows as the new keys fill it, not for the whole batch up front: a batch with many duplicates
+      *  would double the buffer for keys which are never inserted. Call `reserve` first if the keys are known to be new.
+      * Return the number of inserted values.
+      */
+    size_t insert_batch(const value_type * values, size_t count)
+    {
+        size_t inserted = 0;
+        forEachHashed(values, count, [](const value_type & value) -> const Key & { return Cell::getKey(value); },
+            [&](size_t i, size_t hash_value)
+            {
+                iterator it;
+                bool insert;
+                if (!emplaceIfZero(values[i], it, insert, hash_value))
+                    emplaceNonZero(values[i], it, insert, hash_value);
+                inserted += insert;
+            });
+
+        return inserted;
+    }
+
+    /** The step of GROUP BY: insert the key with `init` if it is not there yet, otherwise call `merge(mapped, init)` on its mapped value.
+      * Both cases take the single probe of the insertion, where a `find` before or after `insert_unique` would walk the chain twice.
+      */
+    template <typename Mapped, typename Merge>
+    iterator emplace_or_update(const Key & key, const Mapped & init, Merge && merge)
+    {
+        return emplace_or_update(key, hash(key), init, merge);
+    }
+
+    /// `emplace_or_update` with the hash value computed by the caller.
+    template <typename Mapped, typename Merge>
+    iterator emplace_or_update(const Key & key, size_t hash_value, const Mapped & init, Merge && merge)
+    {
+        iterator it;
+        bool insert;
+        value_type value(key, init);
+        if (!emplaceIfZero(value, it, insert, hash_value))
+            emplaceNonZero(value, it, insert, hash_value);
+        if (!insert)
+            merge(it->second, init);
+        return it;
+    }
+
+    /** `emplace_or_update` for the `count` rows of a block of columns, the keys and the values to aggregate.
+      * The keys are hashed ahead and the cells prefetched as in `insert_batch`. The table is not reserved for the block,
+      *  the number of the rows tells nothing about the number of the distinct keys.
+      */
+    template <typename Mapped, typename Merge>
+    void emplace_or_update_batch(const Key * keys, const Mapped * values, size_t count, Merge && merge)
+    {
+        forEachHashed(keys, count, [](const Key & key) -> const Key & { return key; },
+            [&](size_t i, size_t hash_value) { emplace_or_update(keys[i], hash_value, values[i], merge); });
+    }
+
+    /** Merge the `sources` into this table on `num_threads` threads, calling `merge(mapped, value)` for the keys which are here already,
+      *  as `emplace_or_update` does. The sources stay as they are.
+      * The table is reserved for all the elements first, so the buffer doesn't change any more. Then the cells of the sources are scattered
+      *  by the high bits of their place in the buffer, a task per source, and each partition is merged into its own range of the buffer,
+      *  a task per partition, so no cell is written by two threads. The few rows whose chain runs past the end of the range
+      *  are merged at the end on the calling thread.
+      */
+    template <typename Merge>
+    void merge(const std::vector<const Self *> & sources, size_t num_threads, Merge && merge_fn)
+    {
+        static_assert(Grower::linear_probing, "the partitions of the merge are the ranges of the buffer, which only the chains of linear probing keep to");
+
+        /// `mergeRange` only takes the empty cells, the deleted ones would stay on top of the reserved elements.
+        if (deleted_cells)
+            dropDeletedCells();
+
+        size_t total = size;
+        for (const Self * source : sources)
+            total += source->size;
+        reserve(total);
+
+        size_t num_partitions = 1;
+        while (num_partitions < num_threads * 4 && grower.bufSize() / num_partitions > min_merge_cells_per_partition)
+            num_partitions *= 2;
+        size_t partition_shift = grower.size_degree;
+        while ((1ULL << (grower.size_degree - partition_shift)) < num_partitions)
+            --partition_shift;
+
+        std::vector<std::vector<std::vector<MergeRow>>> scattered(sources.size(), std::vector<std::vector<MergeRow>>(num_partitions));
+        runTasks(num_threads, sources.size(), [&](size_t i)
+        {
+            const Self & source = *sources[i];
+            for (size_t j = 0; j < source.grower.bufSize(); ++j)
+                if (!source.buf[j].isZero() && !source.buf[j].isDeleted())
+                {
+                    size_t hash_value = source.buf[j].getHash(hash);
+                    scattered[i][grower.place(hash_value) >> partition_shift].push_back(MergeRow{&source.buf[j], hash_value});
+                }
+        });
+
+        std::vector<std::vector<MergeRow>> overflow(num_partitions);
+        std::vector<size_t> inserted(num_partitions);
+        runTasks(num_threads, num_partitions, [&](size_t partition)
+        {
+            size_t end = (partition + 1) << partition_shift;
+            for (auto & rows : scattered)
+            {
+                inserted[partition] += mergeRange(rows[partition], end, overflow[partition], merge_fn);
+                std::vector<MergeRow>().swap(rows[partition]);
+            }
+        });
+
+        for (size_t partition = 0; partition < num_partitions; ++partition)
+            size += inserted[partition];
+
+        /// The partitions are filled without the checks of `emplaceNonZero`, make sure the chains still end before the rest goes in.
+        if (grower.overflow(size + deleted_cells))
+            resize();
+
+        /// The table is big enough for everything, these don't resize it.
+        for (const auto & rows : overflow)
+            for (const MergeRow & row : rows)
+                emplace_or_update(Cell::getKey(row.cell->getValue()), row.hash_value, row.cell->getValue().second, merge_fn);
+        for (const Self * source : sources)
+            if (source->has_zero)
+                emplace_or_update(Cell::getKey(source->zero_storage.getValue()), source->zero_storage.getValue().second, merge_fn);
+    }
+
+    /// Look up `count` keys and put the results to `results`, prefetching the cells a few keys ahead.
+    void find_batch(const Key * keys, size_t count, iterator * results)
+    {
+        forEachHashed(keys, count, [](const Key & key) -> const Key & { return key; },
+            [&](size_t i, size_t hash_value) { results[i] = find(keys[i], hash_value); });
+    }
+
+    void find_batch(const Key * keys, size_t count, const_iterator * results) const
+    {
+        forEachHashed(keys, count, [](const Key & key) -> const Key & { return key; },
+            [&](size_t i, size_t hash_value) { results[i] = find(keys[i], hash_value); });
+    }
+
     bool erase(const Key & key)
     {
+        if (Cell::isZero(key)) {
+            bool had_zero = this->has_zero;
+            this->has_zero = false;
+            return had_zero;
+        }
+
         size_t hash_value = hash(key);
         size_t place = findCell(key, grower.place(hash_value));
         if(buf[place].isZero() || buf[place].isDeleted()) {
             return false;
         }
-        size_t next_place = grower.next(place);
-        if (buf[next_place].isZero())
-            buf[place].setZero();
-        else
-            buf[place].setDeleted();
+
+        if constexpr (!Cell::use_tombstones) {
+            eraseWithBackwardShift(place);
+        } else {
+            /// A linear chain through the cell would go on to the next one, so if that is empty no chain passes the cell.
+            size_t next_place = grower.next(place);
+            if (Grower::linear_probing && buf[next_place].isZero())
+                buf[place].setZero();
+            else
+            {
+                buf[place].setDeleted();
+                ++deleted_cells;
+            }
+        }
 
         size--;
 
@@ -353,23 +1112,32 @@ public:
     }
 
     iterator find(const Key & x)
+    {
+        return find(x, hash(x));
+    }
+
+    const_iterator find(const Key & x) const
+    {
+        return find(x, hash(x));
+    }
+
+    /// Find with the hash value computed by the caller.
+    iterator find(const Key & x, size_t hash_value)
     {
         if (Cell::isZero(x))
             return this->has_zero ? iteratorToZero() : end();
 
-        size_t hash_value = hash(x);
         size_t place_value = findCell(x, grower.place(hash_value));
-        return !buf[place_value].isZero() ? iterator(this, &buf[place_value]) : end();
+        return !buf[place_value].isInsertable() ? iterator(this, &buf[place_value]) : end();
     }
 
-    const_iterator find(const Key & x) const
+    const_iterator find(const Key & x, size_t hash_value) const
     {
         if (Cell::isZero(x))
             return this->has_zero ? iteratorToZero() : end();
 
-        size_t hash_value = hash(x);
         size_t place_value = findCell(x, grower.place(hash_value));
-        return !buf[place_value].isZero() ? const_iterator(this, &buf[place_value]) : end();
+        return !buf[place_value].isInsertable() ? const_iterator(this, &buf[place_value]) : end();
     }
 
    const_iterator begin() const
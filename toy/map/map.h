@@ -8,7 +8,7 @@
 namespace toy {
 
 // This map is a common interface, which supports different underlying algos.
-template <typename Key, typename Value, typename Compare = std::less<Key>, typename Allocator = StepAllocator<true>, class TreeType = BinarySearchTree<Key, Compare, std::pair<Key, Value>> >
+template <typename Key, typename Value, typename Compare = std::less<Key>, typename Allocator = StepAllocator<true>, class TreeType = BinarySearchTree<Key, Compare, std::pair<Key, Value>, Select1ST<Key, std::pair<Key, Value>>, Allocator> >
 class map
 {
 public:
@@ -24,6 +24,21 @@ public:
         return tree.insert_unique(value_pair);
     }
 
+    /// Insert `count` value pairs in one go, return the number of inserted ones. The tree type has to provide `insert_batch`.
+    size_t insert_batch(const ValuePair * value_pairs, size_t count)
+    {
+        return tree.insert_batch(value_pairs, count);
+    }
+
+    /// Look up `count` keys, the iterator for `keys[i]` goes to `results[i]`. The tree type has to provide `find_batch`.
+    void find_batch(const Key * keys, size_t count, iterator * results) {
+        tree.find_batch(keys, count, results);
+    }
+
+    void find_batch(const Key * keys, size_t count, const_iterator * results) const {
+        tree.find_batch(keys, count, results);
+    }
+
     size_t erase(const Key & key) {
         return tree.erase(key);
     }
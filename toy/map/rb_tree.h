@@ -0,0 +1,352 @@
+#pragma once
+
+#include "bst.h"
+
+namespace toy {
+
+struct RBTreeNodeBase : public TreeNodeBase {
+    bool red = true;
+};
+
+template<typename Value>
+struct RBTreeNode : public RBTreeNodeBase {
+    Value value;
+
+    RBTreeNode(const Value & value_) : value(value_){}
+};
+
+/** The red-black tree with the interface of BinarySearchTree, so that it can be used as the `TreeType` of `toy::map`.
+  * The layout is the same: the root hangs on `header.left` and its parent is the header, missing children are null.
+  */
+template<typename Key, typename Compare, typename Value, typename KeyOfValue = Select1ST<Key, Value>, typename Allocator = StepAllocator<true>>
+class RedBlackTree : public Allocator
+{
+public:
+    using iterator = IteratorImpl<Value, false, RBTreeNode<Value>>;
+    using const_iterator = IteratorImpl<Value, true, RBTreeNode<Value>>;
+
+private:
+    TreeNodeBase header;
+
+    using BasePtr = TreeNodeBase *;
+    using NodePtr = RBTreeNode<Value> *;
+
+    Compare compare_op;
+
+    KeyOfValue key_of_value;
+
+    BasePtr root() const {
+        return header.left;
+    }
+
+    bool isRoot(BasePtr node) const {
+        return node -> parent == &header;
+    }
+
+    /// Null children are black.
+    static bool isRed(BasePtr node) {
+        return node != nullptr && static_cast<RBTreeNodeBase *>(node) -> red;
+    }
+
+    static void setRed(BasePtr node, bool red) {
+        static_cast<RBTreeNodeBase *>(node) -> red = red;
+    }
+
+    int compare(const Key & lhs, const Key & rhs) const {
+        if(compare_op(lhs, rhs)) {
+            return -1;
+        } else if(compare_op(rhs, lhs)) {
+            return 1;
+        }
+        return 0;
+    }
+
+    /// Hang `child` in place of `node`. For the root the parent is the header, whose `left` is the root.
+    void replaceChild(BasePtr node, BasePtr child) {
+        BasePtr parent = node -> parent;
+        if (parent -> left == node)
+            parent -> left = child;
+        else
+            parent -> right = child;
+        if (child != nullptr)
+            child -> parent = parent;
+    }
+
+    void rotateLeft(BasePtr node) {
+        BasePtr right = node -> right;
+        node -> right = right -> left;
+        if (right -> left != nullptr)
+            right -> left -> parent = node;
+        replaceChild(node, right);
+        right -> left = node;
+        node -> parent = right;
+    }
+
+    void rotateRight(BasePtr node) {
+        BasePtr left = node -> left;
+        node -> left = left -> right;
+        if (left -> right != nullptr)
+            left -> right -> parent = node;
+        replaceChild(node, left);
+        left -> right = node;
+        node -> parent = left;
+    }
+
+    /// The new node is red, repaint or rotate while its parent is red too.
+    void insertFixup(BasePtr node) {
+        while (!isRoot(node) && isRed(node -> parent)) {
+            /// A red parent is never the root, so the grandparent is a real node.
+            BasePtr parent = node -> parent;
+            BasePtr grandparent = parent -> parent;
+            if (parent == grandparent -> left) {
+                BasePtr uncle = grandparent -> right;
+                if (isRed(uncle)) {
+                    setRed(parent, false);
+                    setRed(uncle, false);
+                    setRed(grandparent, true);
+                    node = grandparent;
+                } else {
+                    if (node == parent -> right) {
+                        rotateLeft(parent);
+                        node = parent;
+                        parent = node -> parent;
+                    }
+                    setRed(parent, false);
+                    setRed(grandparent, true);
+                    rotateRight(grandparent);
+                }
+            } else {
+                BasePtr uncle = grandparent -> left;
+                if (isRed(uncle)) {
+                    setRed(parent, false);
+                    setRed(uncle, false);
+                    setRed(grandparent, true);
+                    node = grandparent;
+                } else {
+                    if (node == parent -> left) {
+                        rotateRight(parent);
+                        node = parent;
+                        parent = node -> parent;
+                    }
+                    setRed(parent, false);
+                    setRed(grandparent, true);
+                    rotateLeft(grandparent);
+                }
+            }
+        }
+        setRed(root(), false);
+    }
+
+    /// `node` took the place of a removed black node and may be null, so its parent is passed separately.
+    void eraseFixup(BasePtr node, BasePtr parent) {
+        while (node != root() && !isRed(node)) {
+            if (node == parent -> left) {
+                BasePtr sibling = parent -> right;
+                if (isRed(sibling)) {
+                    setRed(sibling, false);
+                    setRed(parent, true);
+                    rotateLeft(parent);
+                    sibling = parent -> right;
+                }
+                if (!isRed(sibling -> left) && !isRed(sibling -> right)) {
+                    setRed(sibling, true);
+                    node = parent;
+                    parent = node -> parent;
+                } else {
+                    if (!isRed(sibling -> right)) {
+                        setRed(sibling -> left, false);
+                        setRed(sibling, true);
+                        rotateRight(sibling);
+                        sibling = parent -> right;
+                    }
+                    setRed(sibling, isRed(parent));
+                    setRed(parent, false);
+                    setRed(sibling -> right, false);
+                    rotateLeft(parent);
+                    node = root();
+                }
+            } else {
+                BasePtr sibling = parent -> left;
+                if (isRed(sibling)) {
+                    setRed(sibling, false);
+                    setRed(parent, true);
+                    rotateRight(parent);
+                    sibling = parent -> left;
+                }
+                if (!isRed(sibling -> left) && !isRed(sibling -> right)) {
+                    setRed(sibling, true);
+                    node = parent;
+                    parent = node -> parent;
+                } else {
+                    if (!isRed(sibling -> left)) {
+                        setRed(sibling -> right, false);
+                        setRed(sibling, true);
+                        rotateLeft(sibling);
+                        sibling = parent -> left;
+                    }
+                    setRed(sibling, isRed(parent));
+                    setRed(parent, false);
+                    setRed(sibling -> left, false);
+                    rotateRight(parent);
+                    node = root();
+                }
+            }
+        }
+        if (node != nullptr)
+            setRed(node, false);
+    }
+
+    void eraseSingleNode(BasePtr node) {
+        bool removed_red = isRed(node);
+        BasePtr child;
+        BasePtr child_parent;
+
+        if (node -> left == nullptr) {
+            child = node -> right;
+            child_parent = node -> parent;
+            replaceChild(node, child);
+        } else if (node -> right == nullptr) {
+            child = node -> left;
+            child_parent = node -> parent;
+            replaceChild(node, child);
+        } else {
+            /// The successor takes the place and the color of the node, so it is the successor which is removed from its place.
+            BasePtr successor = BinarySearchTreeHelper::leftMostNode(node -> right);
+            removed_red = isRed(successor);
+            child = successor -> right;
+            if (successor -> parent == node) {
+                child_parent = successor;
+            } else {
+                child_parent = successor -> parent;
+                replaceChild(successor, child);
+                successor -> right = node -> right;
+                successor -> right -> parent = successor;
+            }
+            replaceChild(node, successor);
+            successor -> left = node -> left;
+            successor -> left -> parent = successor;
+            setRed(successor, isRed(node));
+        }
+
+        freeNode(node);
+
+        if (!removed_red)
+            eraseFixup(child, child_parent);
+    }
+
+    NodePtr findImpl(const Key & key) const {
+        BasePtr node = root();
+        while (node != nullptr) {
+            auto result = compare(key, key_of_value(static_cast<NodePtr>(node)->value));
+            if (result == 0)
+                return static_cast<NodePtr>(node);
+            node = result == 1 ? node -> right : node -> left;
+        }
+        return nullptr;
+    }
+
+    void freeNode (BasePtr node) {
+        Allocator::free((void*)node, sizeof(RBTreeNode<Value>));
+    }
+
+    /// Rotate the left children up while freeing, so that no stack is needed.
+    void freeSubtree(BasePtr node) {
+        while (node != nullptr) {
+            if (node -> left != nullptr) {
+                BasePtr left = node -> left;
+                node -> left = left -> right;
+                left -> right = node;
+                node = left;
+            } else {
+                BasePtr right = node -> right;
+                freeNode(node);
+                node = right;
+            }
+        }
+    }
+
+    NodePtr createNode(const Value & value) {
+        NodePtr ptr = (NodePtr)Allocator::alloc(sizeof(RBTreeNode<Value>));
+        ConstructHelper::CopyConstruct(&ptr -> value, value);
+        ptr -> red = true;
+        return ptr;
+    }
+
+public:
+
+    RedBlackTree() : header() {
+        header.parent = & header;
+    }
+
+    ~RedBlackTree() {
+        if constexpr (!Allocator::free_in_bulk)
+            freeSubtree(root());
+    }
+
+    RedBlackTree(const RedBlackTree &) = delete;
+    RedBlackTree & operator=(const RedBlackTree &) = delete;
+
+    std::pair<iterator, bool> insert_unique(const Value & value) {
+        BasePtr parent = &header;
+        BasePtr * link = &header.left;
+        while (*link != nullptr) {
+            parent = *link;
+            auto result = compare(key_of_value(value), key_of_value(static_cast<NodePtr>(parent)->value));
+            if (result == 0)
+                return std::make_pair(iterator(parent), false);
+            link = result == 1 ? &parent -> right : &parent -> left;
+        }
+
+        NodePtr node = createNode(value);
+        *link = node;
+        node -> parent = parent;
+        insertFixup(node);
+        return std::make_pair(iterator(node), true);
+    }
+
+    bool erase(const Key & key) {
+        NodePtr node = findImpl(key);
+        if (node == nullptr)
+            return false;
+        eraseSingleNode(node);
+        return true;
+    }
+
+    iterator find(const Key & key) {
+        NodePtr node = findImpl(key);
+        if (node == nullptr) {
+            return end();
+        }
+        return iterator(node);
+    }
+
+    const_iterator find(const Key & key) const {
+        NodePtr node = findImpl(key);
+        if (node == nullptr) {
+            return end();
+        }
+        return const_iterator(node);
+    }
+
+    iterator begin() {
+        if(nullptr == root())
+            return &header;
+        return BinarySearchTreeHelper::leftMostNode(root());
+    }
+
+    const_iterator begin() const {
+        if(nullptr == root())
+            return end();
+        return const_iterator(BinarySearchTreeHelper::leftMostNode(root()));
+    }
+
+    iterator end() {
+        return iterator(&header);
+    }
+
+    const_iterator end() const {
+        return const_iterator(const_cast<BasePtr>(&header));
+    }
+};
+
+} // namespace toy
@@ -0,0 +1,260 @@
+#pragma once
+
+#include "hash_table.h"
+
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace toy {
+
+/** A cell of the Robin Hood table. `dist` is one more than the distance of the element from its place, zero for an empty cell,
+  *  so a zero filled buffer is an empty table. The distance is kept next to the value, a probe touches only one cache line.
+  */
+template <typename Value>
+struct RobinHoodSlot
+{
+    Value value;
+    uint32_t dist;
+};
+
+template <class Container_, typename Value, bool is_const>
+class robin_hood_iterator_base
+{
+    using Container = std::conditional_t<is_const, const Container_, Container_>;
+    using value_type = std::conditional_t<is_const, const Value, Value>;
+
+    using Self = robin_hood_iterator_base<Container_, Value, is_const>;
+
+    Container * container;
+    size_t pos;
+
+public:
+    robin_hood_iterator_base() {}
+    robin_hood_iterator_base(Container * container_, size_t pos_) : container(container_), pos(pos_) {}
+
+    bool operator== (const robin_hood_iterator_base & rhs) const { return pos == rhs.pos; }
+    bool operator!= (const robin_hood_iterator_base & rhs) const { return pos != rhs.pos; }
+
+    Self & operator++()
+    {
+        ++pos;
+        while (pos < container->grower.bufSize() && !container->buf[pos].dist)
+            ++pos;
+        return (*this);
+    }
+
+    Self operator ++(int)
+    {
+        Self ret = *this;
+        ++(*this);
+        return ret;
+    }
+
+    value_type & operator* () const { return container->buf[pos].value; }
+    value_type * operator->() const { return &container->buf[pos].value; }
+};
+
+/** Linear probing with Robin Hood displacement: an inserted element takes the cell of an element which is closer to its own place,
+  *  and that one goes on down the chain. So the elements of a chain are sorted by the distance, and a miss stops at the first element
+  *  which is closer to its place than the key would be, instead of running to an empty cell.
+  * The early exit keeps the misses short at high load, so by default the table is filled up to 90%.
+  * `erase` shifts the rest of the chain back by one cell, there are no tombstones.
+  * The interface is the one of `HashTable`, so that it can be used as the `TreeType` of `toy::map`.
+  */
+template<typename Key, typename Cell, typename Grower = HashTableGrower<8, 90>, typename Allocator = StepAllocator<true>>
+class RobinHoodHashTable : public Allocator
+{
+    static_assert(Grower::linear_probing, "the distance is counted along a linear chain");
+
+    using Hash = typename Cell::Hash;
+
+    using Self = RobinHoodHashTable<Key, Cell, Grower, Allocator>;
+
+    using value_type = typename Cell::value_type;
+
+    using Slot = RobinHoodSlot<value_type>;
+
+public:
+    class iterator : public robin_hood_iterator_base<Self, value_type, false> {
+    public:
+        using robin_hood_iterator_base<Self, value_type, false>::robin_hood_iterator_base;
+    };
+
+    class const_iterator : public robin_hood_iterator_base<Self, value_type, true> {
+    public:
+        using robin_hood_iterator_base<Self, value_type, true>::robin_hood_iterator_base;
+    };
+
+// FIXME:: friend class does not work in gcc :(
+public:
+    Grower grower;
+    Slot * buf;
+
+private:
+    Hash hash;
+
+    size_t size;
+
+    /** Walk the chain of the key. Stop at the key, or at the first cell whose element is closer to its place than the key would be,
+      *  which is where the key belongs. `dist` gets the distance of the key at that cell, so the key is found if `buf[pos].dist == dist`.
+      */
+    size_t probe(const Key & x, size_t hash_value, uint32_t & dist) const
+    {
+        size_t pos = grower.place(hash_value);
+        for (dist = 1;; ++dist)
+        {
+            uint32_t cur = buf[pos].dist;
+            if (cur < dist || (cur == dist && Cell::getKey(buf[pos].value) == x))
+                return pos;
+            pos = grower.next(pos);
+        }
+    }
+
+    /// Find the cell with the key, or return bufSize() if there is no such key.
+    size_t findCell(const Key & x, size_t hash_value) const
+    {
+        uint32_t dist;
+        size_t pos = probe(x, hash_value, dist);
+        return buf[pos].dist == dist ? pos : grower.bufSize();
+    }
+
+    /// Put a new element at `pos` where it has the distance `dist`, and push the displaced ones down the chain. Returns `pos`.
+    size_t emplaceAt(size_t pos, uint32_t dist, const value_type & x)
+    {
+        size_t res = pos;
+
+        Slot cur;
+        new(&cur.value) value_type(x);
+        cur.dist = dist;
+
+        for (; buf[pos].dist; pos = grower.next(pos), ++cur.dist)
+        {
+            if (buf[pos].dist < cur.dist)
+            {
+                Slot tmp;
+                memcpy((void *)&tmp, (void *)&buf[pos], sizeof(Slot));
+                memcpy((void *)&buf[pos], (void *)&cur, sizeof(Slot));
+                memcpy((void *)&cur, (void *)&tmp, sizeof(Slot));
+            }
+        }
+        memcpy((void *)&buf[pos], (void *)&cur, sizeof(Slot));
+
+        return res;
+    }
+
+    void alloc(const Grower & new_grower)
+    {
+        buf = reinterpret_cast<Slot *>(Allocator::alloc(new_grower.bufSize() * sizeof(Slot)));
+        grower = new_grower;
+    }
+
+    /// Rehash into a new buffer, inserting the elements one by one.
+    void resize()
+    {
+        Grower new_grower = grower;
+        new_grower.increaseSize();
+
+        Slot * old_buf = buf;
+        size_t old_size = grower.bufSize();
+
+        alloc(new_grower);
+
+        for (size_t i = 0; i < old_size; ++i)
+        {
+            if (!old_buf[i].dist)
+                continue;
+            uint32_t dist;
+            size_t pos = probe(Cell::getKey(old_buf[i].value), hash(Cell::getKey(old_buf[i].value)), dist);
+            emplaceAt(pos, dist, old_buf[i].value);
+        }
+
+        Allocator::free(old_buf, old_size * sizeof(Slot));
+    }
+
+public:
+
+    RobinHoodHashTable()
+    {
+        size = 0;
+        alloc(grower);
+    }
+
+    ~RobinHoodHashTable()
+    {
+        Allocator::free(buf, grower.bufSize() * sizeof(Slot));
+    }
+
+    RobinHoodHashTable(const RobinHoodHashTable &) = delete;
+    RobinHoodHashTable & operator=(const RobinHoodHashTable &) = delete;
+
+    std::pair<iterator, bool> insert_unique(const value_type & x)
+    {
+        const Key & key = Cell::getKey(x);
+        size_t hash_value = hash(key);
+        uint32_t dist;
+        size_t pos = probe(key, hash_value, dist);
+        if (buf[pos].dist == dist)
+            return std::make_pair(iterator(this, pos), false);
+
+        if (grower.overflow(size + 1)) {
+            resize();
+            pos = probe(key, hash_value, dist);
+        }
+
+        pos = emplaceAt(pos, dist, x);
+        ++size;
+
+        return std::make_pair(iterator(this, pos), true);
+    }
+
+    /// Shift the following elements of the chain back by one cell, until an empty cell or an element which is in its place.
+    bool erase(const Key & key)
+    {
+        size_t pos = findCell(key, hash(key));
+        if (pos == grower.bufSize())
+            return false;
+
+        for (size_t next = grower.next(pos); buf[next].dist > 1; pos = next, next = grower.next(next))
+        {
+            memcpy((void *)&buf[pos], (void *)&buf[next], sizeof(Slot));
+            --buf[pos].dist;
+        }
+        buf[pos].dist = 0;
+        --size;
+
+        return true;
+    }
+
+    iterator find(const Key & x)
+    {
+        return iterator(this, findCell(x, hash(x)));
+    }
+
+    const_iterator find(const Key & x) const
+    {
+        return const_iterator(this, findCell(x, hash(x)));
+    }
+
+    const_iterator begin() const
+    {
+        size_t pos = 0;
+        while (pos < grower.bufSize() && !buf[pos].dist)
+            ++pos;
+        return const_iterator(this, pos);
+    }
+
+    iterator begin()
+    {
+        size_t pos = 0;
+        while (pos < grower.bufSize() && !buf[pos].dist)
+            ++pos;
+        return iterator(this, pos);
+    }
+
+    const_iterator end() const         { return const_iterator(this, grower.bufSize()); }
+    iterator end()                     { return iterator(this, grower.bufSize()); }
+};
+
+}
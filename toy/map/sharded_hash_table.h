@@ -0,0 +1,155 @@
+#pragma once
+
+#include "hash_table.h"
+#include "hash.h"
+
+#include <mutex>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace toy {
+
+template <class Container_, typename Value, bool is_const>
+class sharded_iterator_base
+{
+    using Container = std::conditional_t<is_const, const Container_, Container_>;
+    using value_type = std::conditional_t<is_const, const Value, Value>;
+    using table_iterator = std::conditional_t<is_const, typename Container_::Table::const_iterator, typename Container_::Table::iterator>;
+
+    using Self = sharded_iterator_base<Container_, Value, is_const>;
+
+    Container * container;
+    size_t shard;
+    table_iterator it;
+
+    /// Skip the ended shards, the end of the whole table is the end of the last shard.
+    void skipEmpty()
+    {
+        while (shard + 1 < Container_::num_shards && it == container->shards[shard].table.end())
+        {
+            ++shard;
+            it = container->shards[shard].table.begin();
+        }
+    }
+
+public:
+    sharded_iterator_base() {}
+    sharded_iterator_base(Container * container_, size_t shard_, table_iterator it_) : container(container_), shard(shard_), it(it_)
+    {
+        skipEmpty();
+    }
+
+    bool operator== (const sharded_iterator_base & rhs) const { return shard == rhs.shard && it == rhs.it; }
+    bool operator!= (const sharded_iterator_base & rhs) const { return !(*this == rhs); }
+
+    Self & operator++()
+    {
+        ++it;
+        skipEmpty();
+        return (*this);
+    }
+
+    Self operator ++(int)
+    {
+        Self ret = *this;
+        ++(*this);
+        return ret;
+    }
+
+    value_type & operator* () const { return *it; }
+    value_type * operator->() const { return &*it; }
+};
+
+/** `2^shard_bits` independent hash tables, each behind its own lock. A key goes to the shard given by the high bits of its hash,
+  *  so the threads working with different shards never wait for each other, and a resize stalls only one shard.
+  * The iterators are not protected by the locks, use them only when no other thread changes the table.
+  */
+template<typename Key, typename Cell, size_t shard_bits = 4, typename Table_ = HashTable<Key, Cell>>
+class ShardedHashTable
+{
+    using Hash = typename Cell::Hash;
+
+    using Self = ShardedHashTable<Key, Cell, shard_bits, Table_>;
+
+    using value_type = typename Cell::value_type;
+
+public:
+    using Table = Table_;
+
+    static constexpr size_t num_shards = 1ULL << shard_bits;
+
+    class iterator : public sharded_iterator_base<Self, value_type, false> {
+    public:
+        using sharded_iterator_base<Self, value_type, false>::sharded_iterator_base;
+    };
+
+    class const_iterator : public sharded_iterator_base<Self, value_type, true> {
+    public:
+        using sharded_iterator_base<Self, value_type, true>::sharded_iterator_base;
+    };
+
+    /// The lock and the table of a shard share the cache lines with no other shard.
+    struct alignas(64) Shard
+    {
+        std::mutex mutex;
+        Table table;
+    };
+
+// FIXME:: friend class does not work in gcc :(
+public:
+    Shard shards[num_shards];
+
+private:
+    Hash hash;
+
+    /// The tables take the low bits of the hash, and `std::hash` is the identity for integers, so mix the bits before taking the high ones.
+    size_t shardOf(const Key & key) const
+    {
+        if constexpr (shard_bits == 0)
+            return 0;
+        else
+            return intHash64(hash(key)) >> (64 - shard_bits);
+    }
+
+public:
+
+    std::pair<iterator, bool> insert_unique(const value_type & x)
+    {
+        size_t shard = shardOf(Cell::getKey(x));
+        std::lock_guard<std::mutex> lock(shards[shard].mutex);
+        auto res = shards[shard].table.insert_unique(x);
+        return std::make_pair(iterator(this, shard, res.first), res.second);
+    }
+
+    bool erase(const Key & key)
+    {
+        size_t shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shards[shard].mutex);
+        return shards[shard].table.erase(key);
+    }
+
+    iterator find(const Key & key)
+    {
+        size_t shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(shards[shard].mutex);
+        auto it = shards[shard].table.find(key);
+        return it == shards[shard].table.end() ? end() : iterator(this, shard, it);
+    }
+
+    const_iterator find(const Key & key) const
+    {
+        size_t shard = shardOf(key);
+        std::lock_guard<std::mutex> lock(const_cast<std::mutex &>(shards[shard].mutex));
+        auto it = shards[shard].table.find(key);
+        return it == shards[shard].table.end() ? end() : const_iterator(this, shard, it);
+    }
+
+    iterator begin()                   { return iterator(this, 0, shards[0].table.begin()); }
+    const_iterator begin() const       { return const_iterator(this, 0, shards[0].table.begin()); }
+
+    iterator end()                     { return iterator(this, num_shards - 1, shards[num_shards - 1].table.end()); }
+    const_iterator end() const         { return const_iterator(this, num_shards - 1, shards[num_shards - 1].table.end()); }
+};
+
+}
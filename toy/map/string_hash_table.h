@@ -0,0 +1,173 @@
+#pragma once
+
+#include "hash_table.h"
+#include "hash.h"
+#include "arena.h"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+
+namespace toy {
+
+/// The bytes of a string owned by somebody else. The key of the string hash table.
+struct StringRef
+{
+    const char * data = nullptr;
+    size_t size = 0;
+
+    StringRef() {}
+    StringRef(const char * data_, size_t size_) : data(data_), size(size_) {}
+    StringRef(const std::string & s) : data(s.data()), size(s.size()) {}
+
+    std::string toString() const { return std::string(data, size); }
+
+    bool operator== (const StringRef & rhs) const { return size == rhs.size && (size == 0 || memcmp(data, rhs.data, size) == 0); }
+    bool operator!= (const StringRef & rhs) const { return !(*this == rhs); }
+};
+
+/// Eight bytes at a time through the mixing of wyhash. The tail is padded with zeros, the size goes in first, so "a" and "a\0" differ.
+struct StringRefHash
+{
+    size_t operator()(const StringRef & x) const
+    {
+        uint64_t res = x.size;
+        const char * pos = x.data;
+        size_t left = x.size;
+        for (; left >= 8; pos += 8, left -= 8)
+        {
+            uint64_t word;
+            memcpy(&word, pos, 8);
+            res = wyHash64(res ^ word);
+        }
+        if (left)
+        {
+            uint64_t word = 0;
+            memcpy(&word, pos, left);
+            res = wyHash64(res ^ word);
+        }
+        return res;
+    }
+};
+
+/** The cell for string keys. Next to the reference to the bytes it keeps the hash value, so a resize never reads the bytes,
+  *  and the first 8 bytes of the key, so the keys of a chain are mostly told apart without going to the bytes.
+  * The empty string is the zero key. `erase` shifts the chain back, like with `BackwardShiftHashMapCell`.
+  */
+template <typename TMapped, typename Hash_ = StringRefHash>
+struct StringHashMapCell
+{
+    using Mapped = TMapped;
+
+    using Hash = Hash_;
+
+    using value_type = std::pair<StringRef, Mapped>;
+
+    value_type value;
+
+    size_t saved_hash;
+
+    uint64_t prefix;
+
+    static uint64_t prefixOf(const StringRef & key)
+    {
+        uint64_t res = 0;
+        if (key.size)
+            memcpy(&res, key.data, std::min<size_t>(key.size, 8));
+        return res;
+    }
+
+    StringHashMapCell() {}
+    StringHashMapCell(const value_type & value_) : value(value_), saved_hash(0), prefix(prefixOf(value_.first)) {}
+
+    value_type & getValue() { return value; }
+    const value_type & getValue() const { return value; }
+
+    static StringRef & getKey(value_type & value) { return value.first; }
+    static const StringRef & getKey(const value_type & value) { return value.first; }
+
+    bool keyEquals(const StringRef & key_) const
+    {
+        return value.first.size == key_.size && prefix == prefixOf(key_)
+            && (key_.size <= 8 || memcmp(value.first.data + 8, key_.data + 8, key_.size - 8) == 0);
+    }
+
+    size_t getHash(const Hash & /*hash*/) const { return saved_hash; }
+
+    void setHash(size_t hash_value) { saved_hash = hash_value; }
+
+    bool isZero() const { return value.first.size == 0; }
+
+    static bool isZero(const StringRef & key) { return key.size == 0; }
+
+    bool isInsertable() const {return isZero();}
+
+    /// Set the key value to zero.
+    void setZero() { value.first = StringRef(); }
+
+    static constexpr bool need_zero_value_storage = true;
+
+    static constexpr bool use_tombstones = false;
+
+    bool isDeleted() const { return false; }
+
+    void setMapped(const value_type & value_) { value.second = value_.second; }
+};
+
+/** `HashTable` with string keys whose bytes live in the arena of the table, there is no allocation per key.
+  * A key is looked up with the bytes of the caller, and copied into the arena only when it is really inserted,
+  *  so nothing is copied for a key which is already there. The bytes of the erased keys stay in the arena until the table is destroyed.
+  * The interface is the one of `HashTable`, so that it can be used as the `TreeType` of `toy::map<StringRef, Mapped>`.
+  */
+template <typename Mapped, typename Grower = HashTableGrower<>, typename Allocator = StepAllocator<true>>
+class StringHashTable
+{
+public:
+    using Table = HashTable<StringRef, StringHashMapCell<Mapped>, Grower, Allocator>;
+    using iterator = typename Table::iterator;
+    using const_iterator = typename Table::const_iterator;
+
+    using value_type = std::pair<StringRef, Mapped>;
+
+    std::pair<iterator, bool> insert_unique(const value_type & x)
+    {
+        auto res = table.insert_unique(x);
+        if (res.second)
+            res.first->first = x.first.size ? StringRef(arena.insert(x.first.data, x.first.size), x.first.size) : StringRef();
+        return res;
+    }
+
+    bool erase(const StringRef & key)
+    {
+        return table.erase(key);
+    }
+
+    iterator find(const StringRef & key)
+    {
+        return table.find(key);
+    }
+
+    const_iterator find(const StringRef & key) const
+    {
+        return table.find(key);
+    }
+
+    iterator begin()                   { return table.begin(); }
+    const_iterator begin() const       { return table.begin(); }
+
+    iterator end()                     { return table.end(); }
+    const_iterator end() const         { return table.end(); }
+
+    /// The memory of the cells and of the key bytes.
+    size_t allocatedBytes() const
+    {
+        return table.grower.bufSize() * sizeof(StringHashMapCell<Mapped>) + arena.allocatedBytes();
+    }
+
+private:
+    Table table;
+    Arena arena;
+};
+
+}
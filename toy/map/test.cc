@@ -1,9 +1,28 @@
 #include "map.h"
+#include "rb_tree.h"
+#include "bplus_tree.h"
 #include "hash_table.h"
+#include "group_hash_table.h"
+#include "robin_hood_hash_table.h"
+#include "sharded_hash_table.h"
+#include "hash.h"
+#include "string_hash_table.h"
+#include "aggregator.h"
+#include "arena.h"
 #include <iostream>
 #include <time.h>
 #include <map>
+#include <set>
 #include <unordered_map>
+#include <unordered_set>
+#include <random>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <cstdio>
 
 template<class Map>
 void test1(Map & m, const std::string name) {
@@ -50,6 +69,872 @@ void bench(const std::string & name) {
     std::cout<< "structure " << name << " cost time : "<< end_time - begin_time << std::endl;
 }
 
+/// Insert the same keys in sorted, reverse sorted and random order, then look all of them up.
+template<class Map>
+void bench_order(const std::string & name, int elems = 1000000) {
+    std::vector<int> sorted(elems);
+    for (int i = 0; i < elems; i++)
+        sorted[i] = i;
+    std::vector<int> reversed(sorted.rbegin(), sorted.rend());
+    std::vector<int> shuffled = sorted;
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(42));
+
+    for (auto & [order, keys] : {std::make_pair("sorted", &sorted), std::make_pair("reverse", &reversed), std::make_pair("random", &shuffled)})
+    {
+        Map m;
+
+        auto begin_time = getTime();
+        for (int key : *keys)
+            m.insert(std::make_pair(key, key));
+        auto insert_time = getTime();
+
+        volatile int found = 0;
+        for (int key : shuffled)
+            found += m.find(key) != m.end();
+        auto find_time = getTime();
+
+        std::cout << "structure " << name << " " << order << " insert : " << insert_time - begin_time
+                  << " find : " << find_time - insert_time << std::endl;
+    }
+}
+
+/// Many short lived maps, like the ones built for a single request.
+template<class Map>
+void bench_small_maps(const std::string & name, int maps = 100000, int elems = 64) {
+    std::mt19937 rng(42);
+
+    auto begin_time = getTime();
+
+    for (int i = 0; i < maps; i++)
+    {
+        Map m;
+        for (int j = 0; j < elems; j++) {
+            int key = rng();
+            m.insert(std::make_pair(key, j));
+        }
+    }
+
+    auto end_time = getTime();
+
+    std::cout<< "structure " << name << " small maps cost time : "<< end_time - begin_time << std::endl;
+}
+
+/** The maps of a request: a few maps are built and thrown away together, then the arena of the request is reset.
+  * Only the maps with `ArenaAllocator` take their memory from the arena, for the others the scope changes nothing.
+  */
+template<class Map>
+void bench_request_maps(const std::string & name, int requests = 100000, int elems = 64) {
+    std::mt19937 rng(42);
+    toy::Arena arena;
+
+    auto begin_time = getTime();
+
+    for (int i = 0; i < requests; i++)
+    {
+        {
+            toy::ArenaScope scope(arena);
+            Map users;
+            Map items;
+            Map sessions;
+            for (int j = 0; j < elems; j++) {
+                int key = rng();
+                users.insert(std::make_pair(key, j));
+                items.insert(std::make_pair(key ^ j, j));
+                sessions.insert(std::make_pair(key + j, j));
+            }
+        }
+        arena.reset();
+    }
+
+    auto end_time = getTime();
+
+    std::cout<< "structure " << name << " request maps cost time : "<< end_time - begin_time << std::endl;
+}
+
+/// Build the map from random keys, then look every key up in random order and walk over the whole map.
+template<class Map>
+void bench_scan(const std::string & name, int elems) {
+    std::vector<int> keys(elems);
+    for (int i = 0; i < elems; i++)
+        keys[i] = i;
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(42));
+
+    Map m;
+    for (int key : keys)
+        m.insert(std::make_pair(key, key));
+
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(43));
+
+    volatile int found = 0;
+    auto begin_time = getTime();
+    for (int key : keys)
+        found += m.find(key) != m.end();
+    auto find_time = getTime();
+
+    long long sum = 0;
+    for (auto it = m.begin(); it != m.end(); it++)
+        sum += it->second;
+    auto scan_time = getTime();
+    volatile long long result = sum;
+    (void)result;
+
+    std::cout << "structure " << name << " elems " << elems
+              << " find : " << (find_time - begin_time) / elems
+              << " scan : " << double(scan_time - find_time) / elems << std::endl;
+}
+
+/// Load random keys one by one and as a batch, then look them up the same two ways.
+template<class Map>
+void bench_batch(const std::string & name, size_t elems = 1 << 24) {
+    std::mt19937 rng(42);
+    std::vector<std::pair<int, int>> values(elems);
+    std::vector<int> keys(elems);
+    for (size_t i = 0; i < elems; i++) {
+        keys[i] = rng();
+        values[i] = std::make_pair(keys[i], int(i));
+    }
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    Map single;
+    auto begin_time = getTime();
+    for (auto & value : values)
+        single.insert(value);
+    auto single_insert_time = getTime();
+
+    Map batch;
+    batch.insert_batch(values.data(), values.size());
+    auto batch_insert_time = getTime();
+
+    volatile size_t found = 0;
+    for (int key : keys)
+        found += single.find(key) != single.end();
+    auto single_find_time = getTime();
+
+    /// The results are consumed in chunks, so that they stay in the cache.
+    size_t chunk_size = 4096;
+    std::vector<typename Map::iterator> results(chunk_size);
+    for (size_t chunk_begin = 0; chunk_begin < elems; chunk_begin += chunk_size) {
+        size_t count = std::min(chunk_size, elems - chunk_begin);
+        batch.find_batch(keys.data() + chunk_begin, count, results.data());
+        for (size_t i = 0; i < count; i++)
+            found += results[i] != batch.end();
+    }
+    auto batch_find_time = getTime();
+
+    std::cout << "structure " << name << " elems " << elems
+              << " insert : " << (single_insert_time - begin_time) / elems
+              << " insert_batch : " << (batch_insert_time - single_insert_time) / elems
+              << " find : " << (single_find_time - batch_insert_time) / elems
+              << " find_batch : " << (batch_find_time - single_find_time) / elems << std::endl;
+}
+
+/// Load the same keys into a growing table, a reserved table and a table built from the range.
+template<class Table>
+void bench_reserve(const std::string & name, size_t elems = 1 << 24) {
+    std::mt19937 rng(42);
+    std::vector<std::pair<int, int>> values(elems);
+    for (size_t i = 0; i < elems; i++)
+        values[i] = std::make_pair(int(rng()), int(i));
+
+    auto begin_time = getTime();
+    {
+        Table t;
+        for (auto & value : values)
+            t.insert_unique(value);
+    }
+    auto grow_time = getTime();
+    {
+        Table t;
+        t.reserve(elems);
+        for (auto & value : values)
+            t.insert_unique(value);
+    }
+    auto reserve_time = getTime();
+    {
+        Table t(values.begin(), values.end());
+    }
+    auto range_time = getTime();
+
+    std::cout << "structure " << name << " elems " << elems
+              << " grow : " << (grow_time - begin_time) / elems
+              << " reserve : " << (reserve_time - grow_time) / elems
+              << " from range : " << (range_time - reserve_time) / elems << std::endl;
+}
+
+/// Rebuild a table from its keys, read it from a file, or map the file, then look up some of the keys.
+template<class Table>
+void bench_load(const std::string & name, size_t elems = 1 << 24, size_t lookups = 1000000) {
+    std::mt19937 rng(42);
+    std::vector<std::pair<int, int>> values(elems);
+    for (size_t i = 0; i < elems; i++)
+        values[i] = std::make_pair(int(rng()), int(i));
+
+    std::string path = "/tmp/toy_hash_table_bench.bin";
+    {
+        Table t(values.begin(), values.end());
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        t.write(fd);
+        close(fd);
+    }
+
+    auto lookup = [&](Table & t) {
+        volatile size_t found = 0;
+        for (size_t i = 0; i < lookups; i++)
+            found += t.find(values[rng() % elems].first) != t.end();
+    };
+
+    auto begin_time = getTime();
+    {
+        Table t(values.begin(), values.end());
+        lookup(t);
+    }
+    auto build_time = getTime();
+    {
+        Table t;
+        int fd = open(path.c_str(), O_RDONLY);
+        t.read(fd);
+        close(fd);
+        lookup(t);
+    }
+    auto read_time = getTime();
+    {
+        Table t;
+        int fd = open(path.c_str(), O_RDONLY);
+        t.readMapped(fd);
+        close(fd);
+        lookup(t);
+    }
+    auto mapped_time = getTime();
+    unlink(path.c_str());
+
+    std::cout << "structure " << name << " elems " << elems << " load and " << lookups << " finds,"
+              << " build : " << build_time - begin_time
+              << " read : " << read_time - build_time
+              << " mmap : " << mapped_time - read_time << std::endl;
+}
+
+/// The same workload as the 20 thread bench of toy/concurrency, the ranges of the threads mostly overlap.
+template<class Map>
+void single_insert(int mid, Map & m) {
+    int insert_time = 80000;
+    m.insert(std::make_pair(mid,mid));
+    for (int i = 0; i < insert_time; i++)
+        m.insert(std::make_pair(mid+i,mid+i));
+}
+
+template<class Map>
+void bench_threads(const std::string & name, int thread_num = 20) {
+    Map m;
+
+    auto begin_time = getTime();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_num ; i++) {
+        threads.push_back(std::thread(single_insert<Map>, i * 1000 + 500 , std::ref(m)));
+    }
+
+    for (int i = 0; i < thread_num; i++) {
+        threads[i].join();
+    }
+
+    auto end_time = getTime();
+
+    std::cout<< "structure " << name << " threads " << thread_num << " cost time : "<< end_time - begin_time << std::endl;
+}
+
+/** The workload of `bench_threads`, but each thread inserts into a table of its own, then the tables are merged into one on the same threads.
+  * Compare with the shared tables above and with the 20 thread bench of toy/concurrency.
+  * The merge counts the tables a key is in, the result must be the same as of merging the tables one by one on a single thread.
+  * The destination may start with `tombstones` erased keys, which take the cells until they are dropped. With `std::hash`, the identity,
+  *  they go right after the keys of the first thread, so the merge of a single thread can fill up every cell the tombstones leave.
+  */
+template<class Table>
+void bench_threads_merge(const std::string & name, int thread_num = 20, int keys_per_thread = 80000, int tombstones = 0) {
+    std::vector<std::unique_ptr<Table>> tables;
+    for (int i = 0; i < thread_num; i++)
+        tables.emplace_back(new Table);
+
+    auto begin_time = getTime();
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_num ; i++) {
+        threads.push_back(std::thread([&tables, i, keys_per_thread] {
+            int mid = i * 1000 + 500;
+            for (int j = 0; j < keys_per_thread; j++)
+                tables[i]->insert_unique(std::make_pair(mid + j, 1));
+        }));
+    }
+
+    for (int i = 0; i < thread_num; i++) {
+        threads[i].join();
+    }
+
+    auto build_time = getTime();
+
+    Table res;
+    int first_tombstone = (1 << 24) + 500 + keys_per_thread;
+    for (int key = first_tombstone; key < first_tombstone + tombstones; key++)
+        res.insert_unique(std::make_pair(key, 1));
+    for (int key = first_tombstone; key < first_tombstone + tombstones; key++)
+        res.erase(key);
+
+    std::vector<const Table *> sources;
+    for (auto & table : tables)
+        sources.push_back(table.get());
+    auto add = [](int & mapped, int value) { mapped += value; };
+    res.merge(sources, thread_num, add);
+
+    auto end_time = getTime();
+
+    Table serial;
+    for (auto & table : tables)
+        for (auto it = table->begin(); it != table->end(); ++it)
+            serial.emplace_or_update(it->first, it->second, add);
+
+    size_t elems = 0;
+    bool same = true;
+    for (auto it = res.begin(); it != res.end(); ++it) {
+        elems++;
+        auto serial_it = serial.find(it->first);
+        same &= serial_it != serial.end() && serial_it->second == it->second;
+    }
+    size_t serial_elems = 0;
+    for (auto it = serial.begin(); it != serial.end(); ++it)
+        serial_elems++;
+    same &= elems == serial_elems && res.find(-1) == res.end();
+
+    std::cout<< "structure " << name << " threads " << thread_num << " elems " << elems
+             << " build : " << build_time - begin_time << " merge : " << end_time - build_time << " cost time : "<< end_time - begin_time
+             << " same as serial : " << same << std::endl;
+}
+
+/// The average number of cells a miss walks through, that is the mean distance from a cell to the next empty one.
+template<class Table>
+double missProbeLength(const Table & t) {
+    size_t buf_size = t.grower.bufSize();
+    size_t total = 0;
+    size_t run = 0;
+    /// Start from an empty cell, so that every run is seen from its beginning.
+    size_t start = 0;
+    while (!t.buf[start].isZero())
+        start++;
+    for (size_t i = 1; i <= buf_size; i++) {
+        size_t pos = (start + buf_size - i) % buf_size;
+        if (t.buf[pos].isZero())
+            run = 0;
+        else
+            run++;
+        total += run + 1;
+    }
+    return double(total) / buf_size;
+}
+
+/** Insert, erase and find random keys from a small range, a third each, and check the table against std::set.
+  * At a high fill the deleted cells would take every empty cell, if they were not counted, and a miss would never end.
+  */
+template<class Table>
+void test_churn(const std::string & name, int keys = 300, int ops = 1000000) {
+    Table t;
+    std::set<int> expected;
+    std::mt19937 rng(42);
+    for (int i = 0; i < ops; i++) {
+        int key = rng() % keys + 1;
+        switch (rng() % 3) {
+            case 0:
+                t.insert_unique(std::make_pair(key, key));
+                expected.insert(key);
+                break;
+            case 1:
+                if (t.erase(key) != bool(expected.erase(key)))
+                    throw "wrong erase";
+                break;
+            default:
+                if ((t.find(key) != t.end()) != bool(expected.count(key)))
+                    throw "wrong find";
+        }
+    }
+    std::cout << name << " pass churn test, " << t.grower.bufSize() << " cells" << std::endl;
+}
+
+/** Keep the size of the table constant while erasing and inserting random keys, and watch the probe length.
+  * The table has room for twice the elements, so that dropping the tombstones never grows the buffer and the tables compared
+  *  keep the same load factor. Use a mixing hash: with the identity the random keys would still hit the places uniformly,
+  *  but the misses would not.
+  */
+template<class Table>
+void bench_churn(const std::string & name, int elems = 100000, int cycles = 2000000, int report_every = 250000) {
+    Table t(2 * elems);
+    std::mt19937 rng(42);
+    std::unordered_set<int> present;
+    std::vector<int> keys;
+    auto random_key = [&] {
+        int key;
+        do
+            key = rng();
+        while (key == 0);
+        return key;
+    };
+    while ((int)keys.size() < elems) {
+        int key = random_key();
+        if (t.insert_unique(std::make_pair(key, key)).second) {
+            keys.push_back(key);
+            present.insert(key);
+        }
+    }
+
+    for (int cycle = 1; cycle <= cycles; cycle++) {
+        size_t idx = rng() % keys.size();
+        t.erase(keys[idx]);
+        present.erase(keys[idx]);
+        for (;;) {
+            int key = random_key();
+            if (t.insert_unique(std::make_pair(key, key)).second) {
+                keys[idx] = key;
+                present.insert(key);
+                break;
+            }
+        }
+
+        if (cycle % report_every == 0) {
+            int lookups = 100000;
+            std::vector<int> misses;
+            while ((int)misses.size() < lookups) {
+                int key = random_key();
+                if (!present.count(key))
+                    misses.push_back(key);
+            }
+
+            volatile int found = 0;
+            auto begin_time = getTime();
+            for (int i = 0; i < lookups; i++)
+                found += t.find(keys[i % keys.size()]) != t.end();
+            auto hit_time = getTime();
+            for (int key : misses)
+                found += t.find(key) != t.end();
+            auto miss_time = getTime();
+
+            std::cout << "structure " << name << " cycles " << cycle
+                      << " load factor : " << double(elems) / t.grower.bufSize()
+                      << " miss probe length : " << missProbeLength(t)
+                      << " hit find : " << (hit_time - begin_time) / lookups
+                      << " miss find : " << (miss_time - hit_time) / lookups << std::endl;
+        }
+    }
+}
+
+/// Look up present and absent keys, the load factor is given by the number of keys.
+template<class Table>
+void bench_lookup(const std::string & name, size_t elems) {
+    Table t;
+    std::mt19937 rng(42);
+    std::vector<int> keys;
+    while (keys.size() < elems) {
+        int key = rng() | 1;
+        if (t.insert_unique(std::make_pair(key, key)).second)
+            keys.push_back(key);
+    }
+
+    int lookups = 1000000;
+    std::vector<int> hits(lookups);
+    std::vector<int> misses(lookups);
+    for (int i = 0; i < lookups; i++) {
+        hits[i] = keys[rng() % keys.size()];
+        /// Even keys are never inserted.
+        misses[i] = int(rng()) & ~1;
+    }
+
+    volatile int found = 0;
+    auto begin_time = getTime();
+    for (int i = 0; i < lookups; i++)
+        found += t.find(hits[i]) != t.end();
+    auto hit_time = getTime();
+    for (int i = 0; i < lookups; i++)
+        found += t.find(misses[i]) != t.end();
+    auto miss_time = getTime();
+
+    std::cout << "structure " << name << " load factor : " << double(keys.size()) / t.grower.bufSize()
+              << " hit find : " << (hit_time - begin_time) / lookups
+              << " miss find : " << (miss_time - hit_time) / lookups << std::endl;
+}
+
+/** Fill a table of 2^20 cells up to its maximum fill and look up with `hit_percent` of the keys present.
+  * The keys are uniformly random, so the chains depend only on the load factor and the probing.
+  */
+template<class Table>
+void bench_probing(const std::string & name, size_t degree = 20, int lookups = 1000000) {
+    Table t;
+    size_t elems = decltype(t.grower)::maxFill(degree);
+    std::mt19937 rng(42);
+    std::vector<int> keys;
+    while (keys.size() < elems) {
+        int key = rng();
+        if (key && t.insert_unique(std::make_pair(key, key)).second)
+            keys.push_back(key);
+    }
+
+    std::vector<int> misses;
+    while ((int)misses.size() < lookups) {
+        int key = rng();
+        if (key && t.find(key) == t.end())
+            misses.push_back(key);
+    }
+
+    std::cout << "structure " << name << " load factor : " << double(keys.size()) / t.grower.bufSize();
+    for (int hit_percent : {100, 50, 0}) {
+        std::vector<int> queries(lookups);
+        for (int i = 0; i < lookups; i++)
+            queries[i] = int(rng() % 100) < hit_percent ? keys[rng() % keys.size()] : misses[i];
+
+        volatile int found = 0;
+        auto begin_time = getTime();
+        for (int i = 0; i < lookups; i++)
+            found += t.find(queries[i]) != t.end();
+        std::cout << " " << hit_percent << "% hit find : " << (getTime() - begin_time) / lookups;
+    }
+    std::cout << std::endl;
+}
+
+/** Insert and find `keys` in a `HashTable` with the hash, and print the histogram of the probe lengths of the hits.
+  * The probe length of a hit is the distance of its cell from the place of the key plus one, the buckets are 1, 2, 3-4, 5-8, ...
+  */
+template<class Hash>
+void bench_hash(const std::string & name, const std::string & pattern, const std::vector<int> & keys) {
+    toy::HashTable<int, toy::HashMapCell<int, int, Hash>> t;
+
+    auto begin_time = getTime();
+    for (int key : keys)
+        t.insert_unique(std::make_pair(key, key));
+    auto insert_time = getTime();
+    volatile int found = 0;
+    for (int key : keys)
+        found += t.find(key) != t.end();
+    auto find_time = getTime();
+
+    static constexpr size_t buckets = 12;
+    size_t histogram[buckets] = {};
+    size_t total = 0;
+    size_t longest = 0;
+    size_t elems = 0;
+    Hash hash;
+    for (size_t i = 0; i < t.grower.bufSize(); i++) {
+        if (t.buf[i].isZero())
+            continue;
+        size_t length = ((i - t.grower.place(hash(t.buf[i].getValue().first))) & t.grower.mask()) + 1;
+        size_t bucket = 0;
+        while (bucket + 1 < buckets && (1ULL << bucket) < length)
+            bucket++;
+        histogram[bucket]++;
+        total += length;
+        longest = std::max(longest, length);
+        elems++;
+    }
+
+    std::cout << "hash " << name << " keys " << pattern << " insert : " << (insert_time - begin_time) / keys.size()
+              << " find : " << (find_time - insert_time) / keys.size() << " mean probe length : " << double(total) / elems
+              << " max : " << longest << " histogram :";
+    for (size_t bucket = 0; bucket < buckets; bucket++)
+        std::cout << " " << histogram[bucket];
+    std::cout << std::endl;
+}
+
+template<class Hash>
+void bench_hash_patterns(const std::string & name, int elems = 1 << 20) {
+    std::vector<int> keys(elems);
+
+    for (int i = 0; i < elems; i++)
+        keys[i] = i + 1;
+    bench_hash<Hash>(name, "sequential", keys);
+
+    /// The keys of the threads in toy/concurrency/test.cc, with the identity hash they get only every 8th place.
+    for (int i = 0; i < elems; i++)
+        keys[i] = i * 1000 + 500;
+    bench_hash<Hash>(name, "strided", keys);
+
+    std::mt19937 rng(42);
+    for (int i = 0; i < elems; i++)
+        keys[i] = rng() | 1;
+    bench_hash<Hash>(name, "random", keys);
+}
+
+/** Count the occurrences of string keys. Every key comes twice, so half of the inserts find the key already there,
+  *  which must cost neither a copy of the key nor an allocation.
+  */
+template<class Map>
+void bench_strings(const std::string & name, const std::string & pattern, const std::vector<std::string> & keys) {
+    std::vector<const std::string *> stream;
+    for (const std::string & key : keys) {
+        stream.push_back(&key);
+        stream.push_back(&key);
+    }
+    std::shuffle(stream.begin(), stream.end(), std::mt19937(42));
+
+    Map m;
+    auto begin_time = getTime();
+    for (const std::string * key : stream) {
+        if constexpr (std::is_same_v<Map, std::unordered_map<std::string, int>>)
+            ++m.try_emplace(*key, 0).first->second;
+        else
+            ++m.insert(std::make_pair(toy::StringRef(*key), 0)).first->second;
+    }
+    auto insert_time = getTime();
+    volatile int found = 0;
+    for (const std::string * key : stream) {
+        if constexpr (std::is_same_v<Map, std::unordered_map<std::string, int>>)
+            found += m.find(*key)->second;
+        else
+            found += m.find(toy::StringRef(*key))->second;
+    }
+    auto find_time = getTime();
+
+    std::cout << "structure " << name << " keys " << pattern << " insert : " << (insert_time - begin_time) / stream.size()
+              << " find : " << (find_time - insert_time) / stream.size() << std::endl;
+}
+
+/// The memory of the process in transparent huge pages and in the pages of MAP_HUGETLB, in KB.
+std::pair<size_t, size_t> getHugePages() {
+    std::pair<size_t, size_t> res(0, 0);
+    FILE * file = fopen("/proc/self/smaps_rollup", "r");
+    if (!file)
+        return res;
+    char line[256];
+    while (fgets(line, sizeof(line), file)) {
+        size_t kb;
+        if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+            res.first = kb;
+        else if (sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1)
+            res.second = kb;
+    }
+    fclose(file);
+    return res;
+}
+
+/** Random `find` in a table far bigger than the reach of the TLB, so that with 4KB pages almost every probe misses the TLB too.
+  * Run it with the allocators of the different huge page modes. The table is reserved up front, so MAP_HUGETLB needs 384 pages of 2MB
+  *  in /proc/sys/vm/nr_hugepages, and a growing table would need the old buffer as well. When the pool is short the allocator falls back
+  *  to the transparent huge pages.
+  */
+template<class Table>
+void bench_huge_pages(const std::string & name, size_t elems = 1 << 25, size_t lookups = 10000000) {
+    std::mt19937 rng(42);
+    std::vector<int> keys(elems);
+    for (int & key : keys)
+        key = rng();
+
+    Table t;
+    t.reserve(elems);
+    for (int key : keys)
+        t.insert_unique(std::make_pair(key, key));
+
+    std::vector<int> lookup_keys(lookups);
+    for (int & key : lookup_keys)
+        key = keys[rng() % elems];
+
+    volatile size_t found = 0;
+    auto begin_time = getTime();
+    for (int key : lookup_keys)
+        found += t.find(key) != t.end();
+    auto find_time = getTime();
+
+    auto huge_pages = getHugePages();
+    std::cout << "structure " << name << " elems " << elems << " find : " << double(find_time - begin_time) / lookups
+              << " transparent huge pages MB : " << huge_pages.first / 1024 << " hugetlb MB : " << huge_pages.second / 1024 << std::endl;
+}
+
+/// The resident memory of the process in KB.
+size_t getRss() {
+    size_t pages = 0, resident = 0;
+    FILE * file = fopen("/proc/self/statm", "r");
+    if (!file)
+        return 0;
+    if (fscanf(file, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/** Insert random keys until the buffer has 2^max_degree cells. For each growth to 2^min_degree cells and more, report the pause of the insert
+  *  which resized the table and the resident memory after it. Then check that all the keys are still found.
+  */
+template<class Table>
+void bench_resize_steps(const std::string & name, size_t min_degree = 20, size_t max_degree = 28) {
+    std::mt19937 rng(42);
+    Table t;
+    size_t rss_before = getRss();
+
+    size_t elems = 0;
+    while (size_t(t.grower.size_degree) < max_degree) {
+        int degree = t.grower.size_degree;
+        int key = rng();
+        auto begin_time = getTime();
+        t.insert_unique(std::make_pair(key, key));
+        auto end_time = getTime();
+        elems++;
+
+        if (t.grower.size_degree != degree && size_t(t.grower.size_degree) >= min_degree)
+            std::cout << "structure " << name << " resize to 2^" << int(t.grower.size_degree) << " cells pause : " << (end_time - begin_time) / 1000
+                      << " us rss MB : " << (getRss() - rss_before) / 1024 << std::endl;
+    }
+
+    rng.seed(42);
+    size_t found = 0;
+    for (size_t i = 0; i < elems; i++) {
+        int key = rng();
+        found += t.find(key) != t.end();
+    }
+    std::cout << "structure " << name << " elems " << elems << " found after resizes : " << found << std::endl;
+}
+
+/** Fill the tables of 2^degree cells to the max fill, then time the resize to twice as many elements, on one thread and on `threads` threads.
+  * The cells must be the same in both buffers.
+  */
+template<size_t threads>
+void bench_parallel_resize(size_t degree = 25) {
+    using SerialTable = toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::ParallelHashTableGrower<1>>;
+    using Table = toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::ParallelHashTableGrower<threads>>;
+
+    size_t elems = toy::HashTableGrower<>::maxFill(degree);
+    std::mt19937 rng(42);
+    SerialTable serial(elems);
+    Table t(elems);
+    for (size_t i = 0; i < elems; i++) {
+        int key = rng();
+        serial.insert_unique(std::make_pair(key, key));
+        t.insert_unique(std::make_pair(key, key));
+    }
+
+    auto begin_time = getTime();
+    serial.reserve(elems * 2);
+    auto serial_time = getTime();
+    t.reserve(elems * 2);
+    auto parallel_time = getTime();
+
+    bool same = serial.grower.bufSize() == t.grower.bufSize();
+    for (size_t i = 0; same && i < t.grower.bufSize(); i++)
+        same = serial.buf[i].isZero() ? t.buf[i].isZero() : t.buf[i].getValue() == serial.buf[i].getValue();
+
+    std::cout << "structure hash table resize from 2^" << degree << " cells threads " << threads << " serial : " << (serial_time - begin_time) / 1000000
+              << " ms parallel : " << (parallel_time - serial_time) / 1000000 << " ms same cells : " << same << std::endl;
+}
+
+/// The merge of COUNT and SUM.
+struct Add {
+    template <typename T>
+    void operator()(T & res, const T & value) const { res += value; }
+};
+
+/** COUNT(*) GROUP BY key over `rows` rows with the keys drawn from [0, distinct), in blocks of columns. A key column of 2^24 rows is generated once
+  *  and read over and over, the column of the counts is all ones.
+  * The table is filled by `insert_unique` and a `find` for the update, by `emplace_or_update` row by row and by the batch,
+  *  then by the aggregator on `thread_num` threads, each with its own part of the rows.
+  */
+void bench_group_by(size_t distinct, size_t rows = 100000000, int thread_num = 4) {
+    using Table = toy::HashTable<uint64_t, toy::HashMapCell<uint64_t, uint64_t, toy::MurmurHash<uint64_t>>>;
+
+    const size_t column_size = 1 << 24;
+    const size_t block_size = 65536;
+    std::mt19937_64 rng(42);
+    std::vector<uint64_t> keys(column_size);
+    for (uint64_t & key : keys)
+        key = rng() % distinct;
+    std::vector<uint64_t> ones(block_size, 1);
+
+    /// Call `func(keys, count)` for the blocks of the rows [begin, end).
+    auto for_each_block = [&](size_t begin, size_t end, auto && func) {
+        for (size_t row = begin; row < end;) {
+            size_t offset = row % column_size;
+            size_t count = std::min({block_size, end - row, column_size - offset});
+            func(keys.data() + offset, count);
+            row += count;
+        }
+    };
+
+    /// Call with each aggregated value, then with the name and the time to check the counts and print.
+    uint64_t total = 0;
+    size_t groups = 0;
+    auto count = [&](const std::pair<uint64_t, uint64_t> & value) {
+        total += value.second;
+        ++groups;
+    };
+    auto report = [&](const std::string & name, uint64_t time) {
+        if (total != rows)
+            throw "wrong count";
+        std::cout << "group by " << name << " groups " << groups << " rows " << rows << " cost time : " << time
+                  << " per row : " << double(time) / rows << std::endl;
+        total = 0;
+        groups = 0;
+    };
+
+    {
+        Table t;
+        auto begin_time = getTime();
+        for_each_block(0, rows, [&](const uint64_t * block, size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                t.insert_unique(std::make_pair(block[i], uint64_t(0)));
+                ++t.find(block[i])->second;
+            }
+        });
+        auto end_time = getTime();
+        for (const auto & value : t)
+            count(value);
+        report("insert + find", end_time - begin_time);
+    }
+    {
+        Table t;
+        auto begin_time = getTime();
+        for_each_block(0, rows, [&](const uint64_t * block, size_t count) {
+            for (size_t i = 0; i < count; i++)
+                t.emplace_or_update(block[i], uint64_t(1), Add());
+        });
+        auto end_time = getTime();
+        for (const auto & value : t)
+            count(value);
+        report("emplace_or_update", end_time - begin_time);
+    }
+    {
+        Table t;
+        auto begin_time = getTime();
+        for_each_block(0, rows, [&](const uint64_t * block, size_t count) {
+            t.emplace_or_update_batch(block, ones.data(), count, Add());
+        });
+        auto end_time = getTime();
+        for (const auto & value : t)
+            count(value);
+        report("emplace_or_update_batch", end_time - begin_time);
+    }
+    {
+        std::unordered_map<uint64_t, uint64_t> m;
+        auto begin_time = getTime();
+        for_each_block(0, rows, [&](const uint64_t * block, size_t count) {
+            for (size_t i = 0; i < count; i++)
+                ++m[block[i]];
+        });
+        auto end_time = getTime();
+        for (const auto & value : m)
+            count(value);
+        report("std::unordered_map", end_time - begin_time);
+    }
+    {
+        toy::Aggregator<uint64_t, uint64_t, Add> aggregator(thread_num);
+        auto begin_time = getTime();
+        std::vector<std::thread> threads;
+        for (int i = 0; i < thread_num; i++) {
+            threads.push_back(std::thread([&, i] {
+                for_each_block(rows / thread_num * i, i + 1 == thread_num ? rows : rows / thread_num * (i + 1),
+                    [&](const uint64_t * block, size_t count) { aggregator.add(i, block, ones.data(), count); });
+            }));
+        }
+        for (auto & thread : threads)
+            thread.join();
+        auto aggregate_time = getTime();
+        aggregator.merge(thread_num);
+        auto merge_time = getTime();
+
+        std::cout << "group by aggregator aggregate : " << aggregate_time - begin_time << " merge : " << merge_time - aggregate_time << std::endl;
+        aggregator.forEach(count);
+        report("aggregator, " + std::to_string(thread_num) + " threads", merge_time - begin_time);
+    }
+}
+
 int main() {
     toy::map<int, int> m;
 
@@ -59,10 +944,166 @@ int main() {
 
     test1(m1, "hash table");
 
+    using pool_map = toy::map<int, int, std::less<int>, toy::NodeAllocator<true>>;
+    pool_map m4;
+
+    test1(m4, "bst with node allocator");
+
     bench<std::map<int,int>>(std::string("std::map"));
 
+    bench<pool_map>(std::string("bst with node allocator"));
+
+    using rb_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::RedBlackTree<int, std::less<int>, std::pair<int, int>> >;
+    rb_map m5;
+
+    test1(m5, "red black tree");
+
+    bench<rb_map>(std::string("red black tree"));
+
+    bench_order<std::map<int,int>>(std::string("std::map"));
+    bench_order<rb_map>(std::string("red black tree"));
+    bench_order<toy::map<int, int, std::less<int>, toy::NodeAllocator<true>, toy::RedBlackTree<int, std::less<int>, std::pair<int, int>, toy::Select1ST<int, std::pair<int, int>>, toy::NodeAllocator<true>> >>(std::string("red black tree with node allocator"));
+
+    using bplus_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::BPlusTree<int, std::less<int>, std::pair<int, int>> >;
+    bplus_map m6;
+
+    test1(m6, "b+ tree");
+
+    bench<bplus_map>(std::string("b+ tree"));
+
+    /// Raise the sizes up to 100M keys on a machine with enough memory, std::map needs about 5GB there.
+    for (int elems : {1000000, 10000000}) {
+        bench_scan<std::map<int,int>>(std::string("std::map"), elems);
+        bench_scan<rb_map>(std::string("red black tree"), elems);
+        bench_scan<bplus_map>(std::string("b+ tree"), elems);
+    }
+
+    bench_small_maps<std::map<int,int>>(std::string("std::map"));
+    bench_small_maps<toy::map<int,int>>(std::string("bst"));
+    bench_small_maps<pool_map>(std::string("bst with node allocator"));
+
+    using arena_map = toy::map<int, int, std::less<int>, toy::ArenaAllocator<true>>;
+    using arena_hash_map = toy::map<int, int, std::less<int>, toy::ArenaAllocator<true>,
+        toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<>, toy::ArenaAllocator<true>>>;
+    arena_map m9;
+
+    test1(m9, "bst with arena allocator");
+
+    bench_small_maps<arena_map>(std::string("bst with arena allocator"));
+    bench_request_maps<toy::map<int,int>>(std::string("bst"));
+    bench_request_maps<pool_map>(std::string("bst with node allocator"));
+    bench_request_maps<arena_map>(std::string("bst with arena allocator"));
+    bench_request_maps<hash_map>(std::string("hash table"));
+    bench_request_maps<arena_hash_map>(std::string("hash table with arena allocator"));
+
     bench<hash_map>(std::string("hash table"));
 
     bench<std::unordered_map<int,int>>(std::string("std::unordered_map"));
 
+    bench_batch<hash_map>(std::string("hash table"));
+    bench_reserve<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>> >>(std::string("hash table"));
+    bench_load<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>> >>(std::string("hash table"));
+
+    using sharded_hash_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::ShardedHashTable<int, toy::HashMapCell<int, int, std::hash<int>> > >;
+    sharded_hash_map m7;
+
+    test1(m7, "sharded hash table");
+
+    /// One shard is a single table behind a single lock.
+    bench_threads<toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::ShardedHashTable<int, toy::HashMapCell<int, int, std::hash<int>>, 0> >>(std::string("sharded hash table, 1 shard"));
+    bench_threads<toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::ShardedHashTable<int, toy::HashMapCell<int, int, std::hash<int>>, 2> >>(std::string("sharded hash table, 4 shards"));
+    bench_threads<toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::ShardedHashTable<int, toy::HashMapCell<int, int, std::hash<int>>, 4> >>(std::string("sharded hash table, 16 shards"));
+    bench_threads<toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::ShardedHashTable<int, toy::HashMapCell<int, int, std::hash<int>>, 6> >>(std::string("sharded hash table, 64 shards"));
+    bench_threads<toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::ShardedHashTable<int, toy::HashMapCell<int, int, std::hash<int>>, 8> >>(std::string("sharded hash table, 256 shards"));
+    bench_threads_merge<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>>>(std::string("merged thread hash tables"));
+    /// 199 of the 256 cells are tombstones, the last erased key has an empty cell after it and is cleared. The 57 merged keys would take all the rest.
+    bench_threads_merge<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 90>>>(std::string("merged thread hash tables into tombstones"), 1, 57, 200);
+
+    using shift_hash_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::HashTable<int, toy::BackwardShiftHashMapCell<int, int, std::hash<int>> > >;
+    shift_hash_map m2;
+
+    test1(m2, "backward shift hash table");
+
+    using group_hash_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::GroupHashTable<int, toy::HashMapCell<int, int, std::hash<int>> > >;
+    group_hash_map m3;
+
+    test1(m3, "group hash table");
+
+    bench<group_hash_map>(std::string("group hash table"));
+
+    using robin_hood_hash_map = toy::map<int, int, std::less<int>, toy::StepAllocator<true>, toy::RobinHoodHashTable<int, toy::HashMapCell<int, int, std::hash<int>> > >;
+    robin_hood_hash_map m8;
+
+    test1(m8, "robin hood hash table");
+
+    bench<robin_hood_hash_map>(std::string("robin hood hash table"));
+
+    /// Both tables have 2^20 cells, the first two runs are at the maxFill() of the hash table, the last one at the maxFill() of the group table.
+    bench_lookup<toy::HashTable<int, toy::BackwardShiftHashMapCell<int, int, std::hash<int>> >>(std::string("hash table"), 1 << 19);
+    bench_lookup<toy::GroupHashTable<int, toy::HashMapCell<int, int, std::hash<int>> >>(std::string("group hash table"), 1 << 19);
+    bench_lookup<toy::GroupHashTable<int, toy::HashMapCell<int, int, std::hash<int>> >>(std::string("group hash table"), (1 << 20) / 8 * 7);
+
+    test_churn<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 90> >>(std::string("tombstone hash table, 90% fill"));
+    test_churn<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<4, 90> >>(std::string("tombstone hash table, 90% fill, 16 cells"));
+    test_churn<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 90, toy::QuadraticProbing> >>(std::string("tombstone hash table, 90% fill, quadratic probing"));
+    bench_churn<toy::HashTable<int, toy::HashMapCell<int, int, toy::MurmurHash<int>> >>(std::string("tombstone hash table"));
+    bench_churn<toy::HashTable<int, toy::BackwardShiftHashMapCell<int, int, toy::MurmurHash<int>> >>(std::string("backward shift hash table"));
+    bench_churn<toy::HashTable<int, toy::HashMapCell<int, int, toy::MurmurHash<int>>, toy::HashTableGrower<8, 90> >>(std::string("tombstone hash table, 90% fill"), 200000);
+    bench_churn<toy::HashTable<int, toy::BackwardShiftHashMapCell<int, int, toy::MurmurHash<int>>, toy::HashTableGrower<8, 90> >>(std::string("backward shift hash table, 90% fill"), 200000);
+
+    bench_probing<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 50> >>(std::string("linear probing"));
+    bench_probing<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 75> >>(std::string("linear probing"));
+    bench_probing<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 90> >>(std::string("linear probing"));
+    bench_probing<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 50, toy::QuadraticProbing> >>(std::string("quadratic probing"));
+    bench_probing<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 75, toy::QuadraticProbing> >>(std::string("quadratic probing"));
+    bench_probing<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 90, toy::QuadraticProbing> >>(std::string("quadratic probing"));
+    bench_probing<toy::RobinHoodHashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 50> >>(std::string("robin hood"));
+    bench_probing<toy::RobinHoodHashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 75> >>(std::string("robin hood"));
+    bench_probing<toy::RobinHoodHashTable<int, toy::HashMapCell<int, int, std::hash<int>>, toy::HashTableGrower<8, 90> >>(std::string("robin hood"));
+
+    {
+        using string_hash_map = toy::map<toy::StringRef, int, std::less<toy::StringRef>, toy::StepAllocator<true>, toy::StringHashTable<int> >;
+
+        std::mt19937 rng(42);
+        std::vector<std::string> urls(1 << 20);
+        for (std::string & url : urls)
+            url = "https://www.example.com/catalog/item/" + std::to_string(rng()) + "?ref=" + std::to_string(rng() % 100);
+        std::vector<std::string> user_ids(1 << 20);
+        for (std::string & user_id : user_ids)
+            user_id = "u" + std::to_string(rng());
+
+        bench_strings<std::unordered_map<std::string, int>>(std::string("std::unordered_map"), std::string("url"), urls);
+        bench_strings<string_hash_map>(std::string("string hash table"), std::string("url"), urls);
+        bench_strings<std::unordered_map<std::string, int>>(std::string("std::unordered_map"), std::string("user id"), user_ids);
+        bench_strings<string_hash_map>(std::string("string hash table"), std::string("user id"), user_ids);
+    }
+
+    /// The tables take 768MB.
+    bench_huge_pages<toy::HashTable<int, toy::HashMapCell<int, int, toy::MurmurHash<int>>>>(std::string("hash table, 4KB pages"));
+    bench_huge_pages<toy::HashTable<int, toy::HashMapCell<int, int, toy::MurmurHash<int>>, toy::HashTableGrower<>,
+        toy::StepAllocator<true, toy::HugePages::transparent>>>(std::string("hash table, transparent huge pages"));
+    bench_huge_pages<toy::HashTable<int, toy::HashMapCell<int, int, toy::MurmurHash<int>>, toy::HashTableGrower<>,
+        toy::StepAllocator<true, toy::HugePages::hugetlb>>>(std::string("hash table, hugetlb"));
+    bench_huge_pages<toy::HashTable<int, toy::HashMapCell<int, int, toy::MurmurHash<int>>, toy::HashTableGrower<>,
+        toy::StepAllocator<true, toy::HugePages::transparent, toy::NumaPolicy::interleave>>>(std::string("hash table, transparent huge pages, interleaved"));
+
+    /// The table grows to 2^28 cells, 2GB.
+    bench_resize_steps<toy::HashTable<int, toy::HashMapCell<int, int, std::hash<int>>>>(std::string("hash table"));
+
+    /// The two tables take 1.5GB after the resize.
+    bench_parallel_resize<2>();
+    bench_parallel_resize<4>();
+    bench_parallel_resize<8>();
+    bench_parallel_resize<16>();
+
+    /// With 10M keys the four thread tables of the aggregator take about 2GB.
+    for (size_t distinct : {1000, 1000000, 10000000})
+        bench_group_by(distinct);
+
+    /// Build with -msse4.2 for the CRC32C instruction, the fallback is much slower.
+    bench_hash_patterns<std::hash<int>>(std::string("std::hash"));
+    bench_hash_patterns<toy::MurmurHash<int>>(std::string("murmur"));
+    bench_hash_patterns<toy::WyHash<int>>(std::string("wyhash"));
+    bench_hash_patterns<toy::CRC32Hash<int>>(std::string("crc32c"));
+
 }